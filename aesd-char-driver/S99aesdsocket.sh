@@ -1,16 +1,49 @@
+# History of each device is kept here across a stop and start
+state_dir=/var/lib/aesdchar
+
 case "$1" in
     start)
         # 1. Load driver first
         /usr/bin/aesdchar_load
-        
-        # 2. Fix the tempfile deprecation (The "Fish" fix)
+
+        # 2. Bring back what the devices held when they were last stopped
+        if command -v aesdstate > /dev/null; then
+            for image in $state_dir/aesdchar*.img; do
+                [ -f "$image" ] || continue
+                aesdstate restore /dev/$(basename $image .img) $image && rm -f $image
+            done
+        fi
+
+        # 3. Fix the tempfile deprecation (The "Fish" fix)
         ln -sf /bin/mktemp /usr/bin/tempfile
-        
-        # 3. Start the daemon ONLY after driver is ready
+
+        # 4. Start the daemon ONLY after driver is ready
         start-stop-daemon -S -n aesdsocket -a /usr/bin/aesdsocket -- -d
         ;;
     stop)
         start-stop-daemon -K -n aesdsocket
+
+        # -K returns once SIGTERM is sent, the server may still be draining
+        # for its linger window (5 s by default) with the devices open
+        tries=0
+        while pidof aesdsocket > /dev/null && [ $tries -lt 10 ]; do
+            sleep 1
+            tries=$((tries + 1))
+        done
+        if pidof aesdsocket > /dev/null; then
+            start-stop-daemon -K -s KILL -n aesdsocket
+            while pidof aesdsocket > /dev/null; do
+                sleep 1
+            done
+        fi
+
+        # Save every device before the module and its history go away
+        if command -v aesdstate > /dev/null; then
+            mkdir -p $state_dir
+            for dev in /dev/aesdchar[0-9]*; do
+                [ -c "$dev" ] && aesdstate save $dev $state_dir/$(basename $dev).img
+            done
+        fi
         /usr/bin/aesdchar_unload
         ;;
     *)
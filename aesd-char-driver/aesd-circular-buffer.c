@@ -11,47 +11,143 @@
 
 #include "aesd-circular-buffer.h"
 
+/**
+ * Wrap an index that may have run past the end of the entry array.
+ * @param index must be less than twice the buffer capacity.
+ */
+static inline uint32_t aesd_circular_buffer_wrap(const struct aesd_circular_buffer *buffer, uint32_t index)
+{
+    if (buffer->mask)
+        return index & buffer->mask;
+    return index >= buffer->capacity ? index - buffer->capacity : index;
+}
+
+/**
+ * @param buffer the buffer to inspect
+ * @return the number of entries currently stored in the buffer
+ */
+unsigned int aesd_circular_buffer_count(const struct aesd_circular_buffer *buffer)
+{
+    if (buffer->full)
+        return buffer->capacity;
+    if (buffer->in_offs >= buffer->out_offs)
+        return buffer->in_offs - buffer->out_offs;
+    return buffer->capacity - (buffer->out_offs - buffer->in_offs);
+}
+
+/**
+ * @param buffer the buffer to index.
+ * @param entry_number the zero referenced entry to return, 0 being the oldest.
+ * @param entry_char_offset_rtn if not NULL, set to the offset of the first byte of the
+ *      returned entry relative to the first byte in the buffer.
+ * @return the entry, or NULL if fewer than entry_number + 1 entries are stored.
+ */
+struct aesd_buffer_entry *aesd_circular_buffer_get_entry(struct aesd_circular_buffer *buffer,
+            unsigned int entry_number, size_t *entry_char_offset_rtn)
+{
+    struct aesd_buffer_entry *entry;
+
+    if (entry_number >= aesd_circular_buffer_count(buffer))
+        return NULL;
+
+    entry = &buffer->entry[aesd_circular_buffer_wrap(buffer, buffer->out_offs + entry_number)];
+    if (entry_char_offset_rtn) {
+        *entry_char_offset_rtn = entry->start - buffer->start_offset;
+    }
+    return entry;
+}
+
 /**
  * @param buffer the buffer to search for corresponding offset.
  * @param char_offset the position to search for in the buffer list.
  * @param entry_offset_byte_rtn pointer to store the byte offset within the returned entry.
  * @return the entry representing the position, or NULL if not available.
+ *
+ * Uses the start offsets cached by aesd_circular_buffer_add_entry() to binary
+ * search the stored entries instead of summing their sizes.
  */
 struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
             size_t char_offset, size_t *entry_offset_byte_rtn )
 {
-    size_t cumulative_offset = 0;
-    uint8_t index = buffer->out_offs;
-    int count;
-    
-    // Calculate how many entries we actually have to iterate through
-    int max_entries = 0;
-    if (buffer->full) {
-        max_entries = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-    } else {
-        if (buffer->in_offs >= buffer->out_offs) {
-            max_entries = buffer->in_offs - buffer->out_offs;
+    struct aesd_buffer_entry *entry;
+    unsigned int low = 0;
+    unsigned int high;
+    size_t entry_char_offset = 0;
+
+    if (char_offset >= buffer->total_size || aesd_circular_buffer_count(buffer) == 0)
+        return NULL;
+
+    // Find the last entry starting at or before char_offset
+    high = aesd_circular_buffer_count(buffer) - 1;
+    while (low < high) {
+        unsigned int mid = low + (high - low + 1) / 2;
+
+        aesd_circular_buffer_get_entry(buffer, mid, &entry_char_offset);
+        if (entry_char_offset <= char_offset) {
+            low = mid;
         } else {
-            max_entries = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - (buffer->out_offs - buffer->in_offs);
+            high = mid - 1;
         }
     }
 
-    for (count = 0; count < max_entries; count++) {
-        struct aesd_buffer_entry *entry = &buffer->entry[index];
-        
-        // Check if char_offset falls within this specific entry
-        if (char_offset < (cumulative_offset + entry->size)) {
-            if (entry_offset_byte_rtn) {
-                *entry_offset_byte_rtn = char_offset - cumulative_offset;
-            }
-            return entry;
+    entry = aesd_circular_buffer_get_entry(buffer, low, &entry_char_offset);
+    if (entry_offset_byte_rtn) {
+        *entry_offset_byte_rtn = char_offset - entry_char_offset;
+    }
+    return entry;
+}
+
+/**
+ * Find the first occurrence of @param pattern in @param entry at or after
+ * byte @param from. Candidates are located with memchr() on the first byte
+ * of the pattern and only those are compared in full.
+ * @param offset_rtn set to the offset of the match within the entry.
+ * @return true if the pattern was found, false otherwise or if @param len is 0.
+ */
+bool aesd_buffer_entry_find(const struct aesd_buffer_entry *entry, size_t from,
+            const char *pattern, size_t len, size_t *offset_rtn)
+{
+    const char *p = entry->buffptr + from;
+    const char *end = entry->buffptr + entry->size;
+
+    if (!len || from > entry->size)
+        return false;
+
+    while ((size_t)(end - p) >= len) {
+        p = memchr(p, pattern[0], end - p - len + 1);
+        if (!p)
+            return false;
+        if (memcmp(p + 1, pattern + 1, len - 1) == 0) {
+            *offset_rtn = p - entry->buffptr;
+            return true;
         }
-        
-        cumulative_offset += entry->size;
-        index = (index + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+        p++;
     }
+    return false;
+}
 
-    return NULL;
+/**
+* Removes the oldest entry from buffer, returning its buffptr for freeing, or NULL if
+* the buffer is empty. The slot is cleared, so AESD_CIRCULAR_BUFFER_FOREACH only
+* sees buffptrs the buffer still owns.
+*/
+const char *aesd_circular_buffer_remove_oldest(struct aesd_circular_buffer *buffer)
+{
+    struct aesd_buffer_entry *oldest;
+    const char *buffptr;
+
+    if (!buffer->full && buffer->in_offs == buffer->out_offs)
+        return NULL;
+
+    oldest = &buffer->entry[buffer->out_offs];
+    buffptr = oldest->buffptr;
+    buffer->start_offset += oldest->size;
+    buffer->total_size -= oldest->size;
+    oldest->buffptr = NULL;
+    oldest->size = 0;
+    buffer->out_offs = aesd_circular_buffer_wrap(buffer, buffer->out_offs + 1);
+    buffer->full = false;
+    return buffptr;
 }
 
 /**
@@ -63,16 +159,16 @@ const char *aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer,
 
     // If buffer is full, we are about to overwrite the oldest entry
     if (buffer->full) {
-        ret_ptr = buffer->entry[buffer->out_offs].buffptr;
-        // Advance out_offs as the oldest is being removed/overwritten
-        buffer->out_offs = (buffer->out_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+        ret_ptr = aesd_circular_buffer_remove_oldest(buffer);
     }
 
-    // Add the new entry at the current in_offs
+    // Add the new entry at the current in_offs, right after the newest one
     buffer->entry[buffer->in_offs] = *add_entry;
-    
+    buffer->entry[buffer->in_offs].start = buffer->start_offset + buffer->total_size;
+    buffer->total_size += add_entry->size;
+
     // Advance in_offs
-    buffer->in_offs = (buffer->in_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    buffer->in_offs = aesd_circular_buffer_wrap(buffer, buffer->in_offs + 1);
 
     // If in_offs caught up to out_offs, we are now full
     if (buffer->in_offs == buffer->out_offs) {
@@ -84,8 +180,24 @@ const char *aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer,
 
 /**
 * Initializes the circular buffer described by @param buffer to an empty struct
+* holding up to AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED entries
 */
 void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer)
+{
+    aesd_circular_buffer_init_storage(buffer, buffer->entry_storage, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
+}
+
+/**
+* Initializes the circular buffer described by @param buffer to an empty struct
+* storing its entries in the caller-owned array @param entries of @param capacity slots.
+* @param capacity must be at least 1.
+*/
+void aesd_circular_buffer_init_storage(struct aesd_circular_buffer *buffer,
+            struct aesd_buffer_entry *entries, uint32_t capacity)
 {
     memset(buffer,0,sizeof(struct aesd_circular_buffer));
+    memset(entries,0,sizeof(struct aesd_buffer_entry) * capacity);
+    buffer->entry = entries;
+    buffer->capacity = capacity;
+    buffer->mask = (capacity & (capacity - 1)) == 0 ? capacity - 1 : 0;
 }
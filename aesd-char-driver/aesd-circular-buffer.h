@@ -16,6 +16,10 @@
 #include <stdbool.h>
 #endif
 
+/**
+ * Capacity used by aesd_circular_buffer_init(). Buffers set up with
+ * aesd_circular_buffer_init_storage() may hold any number of entries.
+ */
 #define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10
 
 struct aesd_buffer_entry
@@ -28,27 +32,56 @@ struct aesd_buffer_entry
      * Number of bytes stored in buffptr
      */
     size_t size;
+    /**
+     * Stream offset of the first byte of this entry, counted from the first
+     * byte ever added to the buffer. Set by aesd_circular_buffer_add_entry(),
+     * callers do not need to fill it in. Only differences between two starts
+     * are meaningful, so wrapping around is harmless.
+     */
+    size_t start;
 };
 
 struct aesd_circular_buffer
 {
     /**
-     * An array of pointers to memory allocated for the most recent write operations
+     * An array of pointers to memory allocated for the most recent write operations.
+     * Points at entry_storage unless aesd_circular_buffer_init_storage() was used.
+     */
+    struct aesd_buffer_entry *entry;
+    /**
+     * Number of slots in entry
      */
-    struct aesd_buffer_entry  entry[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    uint32_t capacity;
+    /**
+     * capacity - 1 when capacity is a power of two, letting index wrapping use a
+     * mask. Zero otherwise.
+     */
+    uint32_t mask;
     /**
      * The current location in the entry structure where the next write should
      * be stored.
      */
-    uint8_t in_offs;
+    uint32_t in_offs;
     /**
      * The first location in the entry structure to read from
      */
-    uint8_t out_offs;
+    uint32_t out_offs;
     /**
      * set to true when the buffer entry structure is full
      */
     bool full;
+    /**
+     * Stream offset (see aesd_buffer_entry.start) of the entry at out_offs
+     */
+    size_t start_offset;
+    /**
+     * Sum of the sizes of all entries currently stored
+     */
+    size_t total_size;
+    /**
+     * Default storage for buffers set up with aesd_circular_buffer_init()
+     */
+    struct aesd_buffer_entry entry_storage[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
 };
 
 extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
@@ -56,16 +89,37 @@ extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos
 
 extern const char *aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry);
 
+extern const char *aesd_circular_buffer_remove_oldest(struct aesd_circular_buffer *buffer);
+
 extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
 
+extern void aesd_circular_buffer_init_storage(struct aesd_circular_buffer *buffer,
+            struct aesd_buffer_entry *entries, uint32_t capacity);
+
+extern unsigned int aesd_circular_buffer_count(const struct aesd_circular_buffer *buffer);
+
+extern struct aesd_buffer_entry *aesd_circular_buffer_get_entry(struct aesd_circular_buffer *buffer,
+            unsigned int entry_number, size_t *entry_char_offset_rtn);
+
+extern bool aesd_buffer_entry_find(const struct aesd_buffer_entry *entry, size_t from,
+            const char *pattern, size_t len, size_t *offset_rtn);
+
+/**
+ * @return the total number of bytes currently stored in @param buffer
+ */
+static inline size_t aesd_circular_buffer_total_size(const struct aesd_circular_buffer *buffer)
+{
+    return buffer->total_size;
+}
+
 /**
  * Create a for loop to iterate over each member of the circular buffer.
  * Useful when you've allocated memory for circular buffer entries and need to free it
  * @param entryptr is a struct aesd_buffer_entry* to set with the current entry
  * @param buffer is the struct aesd_buffer * describing the buffer
- * @param index is a uint8_t stack allocated value used by this macro for an index
+ * @param index is a uint32_t stack allocated value used by this macro for an index
  * Example usage:
- * uint8_t index;
+ * uint32_t index;
  * struct aesd_circular_buffer buffer;
  * struct aesd_buffer_entry *entry;
  * AESD_CIRCULAR_BUFFER_FOREACH(entry,&buffer,index) {
@@ -74,7 +128,7 @@ extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
  */
 #define AESD_CIRCULAR_BUFFER_FOREACH(entryptr,buffer,index) \
     for(index=0, entryptr=&((buffer)->entry[index]); \
-            index<AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; \
+            index<(buffer)->capacity; \
             index++, entryptr=&((buffer)->entry[index]))
 
 
@@ -0,0 +1,249 @@
+/**
+ * @file aesd-entry-pool.c
+ * @brief Size-class allocator for aesdchar entry memory
+ *
+ * Entries come from power-of-two kmem_caches, so a partial entry grows
+ * geometrically through the classes instead of being krealloc()ed on every
+ * write. Blocks released by an overwrite are kept on a short per-class free
+ * list and handed out again for the next entry of that size.
+ */
+
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/log2.h>
+#include <linux/atomic.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include "aesd-entry-pool.h"
+
+/**
+ * Classes hold blocks of 64 bytes up to 4 KiB, header included
+ */
+#define AESD_POOL_MIN_SHIFT 6
+#define AESD_POOL_NR_CLASSES 7
+/**
+ * Recycled blocks kept per class, beyond this they go back to the slab
+ */
+#define AESD_POOL_MAX_FREE 64
+
+struct aesd_pool_class
+{
+    struct kmem_cache *cache;
+    size_t block_size;
+    /**
+     * Protects everything below. Taken from SRCU callbacks, hence irqsave.
+     */
+    spinlock_t lock;
+    struct aesd_entry_block *free_list;
+    unsigned int nr_free;
+    /**
+     * Allocations served from free_list
+     */
+    unsigned long hits;
+    /**
+     * Allocations that had to go to the slab cache
+     */
+    unsigned long misses;
+    char name[24];
+};
+
+static struct aesd_pool_class aesd_pool[AESD_POOL_NR_CLASSES];
+static atomic_long_t aesd_pool_huge_allocs;
+
+static unsigned int aesd_pool_class_for(size_t block_size)
+{
+    unsigned int size_class;
+
+    for (size_class = 0; size_class < AESD_POOL_NR_CLASSES; size_class++) {
+        if (block_size <= aesd_pool[size_class].block_size)
+            return size_class;
+    }
+    return AESD_POOL_HUGE;
+}
+
+/**
+ * @param size the number of data bytes needed
+ * @return a block with at least @param size bytes of capacity, or NULL
+ */
+struct aesd_entry_block *aesd_entry_block_alloc(size_t size)
+{
+    size_t block_size = sizeof(struct aesd_entry_block) + size;
+    unsigned int size_class = aesd_pool_class_for(block_size);
+    struct aesd_pool_class *pool_class;
+    struct aesd_entry_block *block;
+    unsigned long flags;
+
+    if (size_class == AESD_POOL_HUGE) {
+        block_size = roundup_pow_of_two(block_size);
+        block = kvmalloc(block_size, GFP_KERNEL);
+        if (!block)
+            return NULL;
+        atomic_long_inc(&aesd_pool_huge_allocs);
+        block->size_class = AESD_POOL_HUGE;
+        block->capacity = block_size - sizeof(*block);
+        return block;
+    }
+
+    pool_class = &aesd_pool[size_class];
+    spin_lock_irqsave(&pool_class->lock, flags);
+    block = pool_class->free_list;
+    if (block) {
+        pool_class->free_list = block->next_free;
+        pool_class->nr_free--;
+        pool_class->hits++;
+    } else {
+        pool_class->misses++;
+    }
+    spin_unlock_irqrestore(&pool_class->lock, flags);
+
+    if (!block) {
+        block = kmem_cache_alloc(pool_class->cache, GFP_KERNEL);
+        if (!block)
+            return NULL;
+    }
+    block->size_class = size_class;
+    block->capacity = pool_class->block_size - sizeof(*block);
+    return block;
+}
+
+/**
+ * Make room for @param size bytes in @param block, which may be NULL.
+ * Moving to the next size class at least doubles the capacity, so appending
+ * to an entry copies each byte a bounded number of times.
+ * @param used the number of bytes of @param block data to keep
+ * @return the block to use from now on, or NULL with @param block untouched
+ */
+struct aesd_entry_block *aesd_entry_block_grow(struct aesd_entry_block *block, size_t used, size_t size)
+{
+    struct aesd_entry_block *new_block;
+
+    if (block && size <= block->capacity)
+        return block;
+
+    new_block = aesd_entry_block_alloc(size);
+    if (!new_block)
+        return NULL;
+    if (block) {
+        memcpy(new_block->data, block->data, used);
+        aesd_entry_block_free(block);
+    }
+    return new_block;
+}
+
+/**
+ * Return @param block to its size class, or to the slab when the class
+ * already has enough spares. Must not be used for blocks readers may still see.
+ */
+void aesd_entry_block_free(struct aesd_entry_block *block)
+{
+    struct aesd_pool_class *pool_class;
+    unsigned long flags;
+    bool recycled = false;
+
+    if (!block)
+        return;
+    if (block->size_class == AESD_POOL_HUGE) {
+        kvfree(block);
+        return;
+    }
+
+    pool_class = &aesd_pool[block->size_class];
+    spin_lock_irqsave(&pool_class->lock, flags);
+    if (pool_class->nr_free < AESD_POOL_MAX_FREE) {
+        block->next_free = pool_class->free_list;
+        pool_class->free_list = block;
+        pool_class->nr_free++;
+        recycled = true;
+    }
+    spin_unlock_irqrestore(&pool_class->lock, flags);
+
+    if (!recycled)
+        kmem_cache_free(pool_class->cache, block);
+}
+
+static void aesd_entry_block_free_rcu(struct rcu_head *head)
+{
+    aesd_entry_block_free(container_of(head, struct aesd_entry_block, rcu));
+}
+
+/**
+ * Recycle @param block once every reader of @param srcu that might have
+ * looked it up has left its read-side critical section.
+ */
+void aesd_entry_block_free_deferred(struct srcu_struct *srcu, struct aesd_entry_block *block)
+{
+    call_srcu(srcu, &block->rcu, aesd_entry_block_free_rcu);
+}
+
+static int aesd_pool_stats_show(struct seq_file *s, void *unused)
+{
+    unsigned int size_class;
+
+    seq_printf(s, "%-8s %6s %12s %12s %6s\n", "block", "free", "hits", "misses", "hit%");
+    for (size_class = 0; size_class < AESD_POOL_NR_CLASSES; size_class++) {
+        struct aesd_pool_class *pool_class = &aesd_pool[size_class];
+        unsigned long hits, misses, flags;
+        unsigned int nr_free;
+
+        spin_lock_irqsave(&pool_class->lock, flags);
+        hits = pool_class->hits;
+        misses = pool_class->misses;
+        nr_free = pool_class->nr_free;
+        spin_unlock_irqrestore(&pool_class->lock, flags);
+
+        seq_printf(s, "%-8zu %6u %12lu %12lu %6lu\n", pool_class->block_size, nr_free, hits, misses,
+                   hits + misses ? hits * 100 / (hits + misses) : 0);
+    }
+    seq_printf(s, "%-8s %6s %12s %12ld %6s\n", "huge", "-", "-",
+               atomic_long_read(&aesd_pool_huge_allocs), "-");
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(aesd_pool_stats);
+
+/**
+ * Expose per size class hit/miss counters as @param parent/pool
+ */
+void aesd_entry_pool_debugfs_init(struct dentry *parent)
+{
+    debugfs_create_file("pool", 0444, parent, NULL, &aesd_pool_stats_fops);
+}
+
+void aesd_entry_pool_exit(void)
+{
+    unsigned int size_class;
+
+    for (size_class = 0; size_class < AESD_POOL_NR_CLASSES; size_class++) {
+        struct aesd_pool_class *pool_class = &aesd_pool[size_class];
+
+        while (pool_class->free_list) {
+            struct aesd_entry_block *block = pool_class->free_list;
+
+            pool_class->free_list = block->next_free;
+            kmem_cache_free(pool_class->cache, block);
+        }
+        pool_class->nr_free = 0;
+        kmem_cache_destroy(pool_class->cache);
+        pool_class->cache = NULL;
+    }
+}
+
+int aesd_entry_pool_init(void)
+{
+    unsigned int size_class;
+
+    for (size_class = 0; size_class < AESD_POOL_NR_CLASSES; size_class++) {
+        struct aesd_pool_class *pool_class = &aesd_pool[size_class];
+
+        pool_class->block_size = 1UL << (AESD_POOL_MIN_SHIFT + size_class);
+        spin_lock_init(&pool_class->lock);
+        snprintf(pool_class->name, sizeof(pool_class->name), "aesd_entry_%zu", pool_class->block_size);
+        pool_class->cache = kmem_cache_create(pool_class->name, pool_class->block_size, 0, 0, NULL);
+        if (!pool_class->cache) {
+            aesd_entry_pool_exit();
+            return -ENOMEM;
+        }
+    }
+    return 0;
+}
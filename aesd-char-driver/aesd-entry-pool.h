@@ -0,0 +1,66 @@
+/*
+ * aesd-entry-pool.h
+ *
+ * @brief Size-class allocator for aesdchar entry memory
+ */
+
+#ifndef AESD_ENTRY_POOL_H
+#define AESD_ENTRY_POOL_H
+
+#include <linux/types.h>
+#include <linux/rcupdate.h>
+#include <linux/srcu.h>
+
+struct dentry;
+
+/**
+ * Every buffptr stored in the circular buffer is the data member of one of
+ * these blocks, so an overwritten entry can be handed to call_srcu() and
+ * recycled only once no lockless reader can still be copying from it.
+ */
+struct aesd_entry_block
+{
+    union {
+        /**
+         * Used while waiting for the SRCU grace period after an overwrite
+         */
+        struct rcu_head rcu;
+        /**
+         * Link in the size class free list once recycled
+         */
+        struct aesd_entry_block *next_free;
+    };
+    /**
+     * Index of the size class this block came from, or AESD_POOL_HUGE
+     */
+    unsigned int size_class;
+    /**
+     * Number of bytes available in data
+     */
+    size_t capacity;
+    char data[];
+};
+
+/**
+ * size_class of blocks too large for the slab caches, allocated with kvmalloc()
+ */
+#define AESD_POOL_HUGE (~0U)
+
+extern int aesd_entry_pool_init(void);
+extern void aesd_entry_pool_exit(void);
+extern void aesd_entry_pool_debugfs_init(struct dentry *parent);
+
+extern struct aesd_entry_block *aesd_entry_block_alloc(size_t size);
+extern struct aesd_entry_block *aesd_entry_block_grow(struct aesd_entry_block *block, size_t used, size_t size);
+extern void aesd_entry_block_free(struct aesd_entry_block *block);
+extern void aesd_entry_block_free_deferred(struct srcu_struct *srcu, struct aesd_entry_block *block);
+
+/**
+ * @return the block holding the entry whose buffptr is @param buffptr
+ */
+static inline struct aesd_entry_block *aesd_entry_block_of(const char *buffptr)
+{
+    return container_of((void *)buffptr, struct aesd_entry_block, data);
+}
+
+#endif /* AESD_ENTRY_POOL_H */
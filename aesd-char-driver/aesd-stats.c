@@ -0,0 +1,117 @@
+/**
+ * @file aesd-stats.c
+ * @brief Per-device counters and latency histograms for aesdchar
+ *
+ * Each device gets a debugfs file aesdchar/aesdcharN/stats. Reading it sums
+ * the per-CPU counters, writing anything to it resets them.
+ */
+
+#include <linux/module.h>
+#include <linux/percpu.h>
+#include <linux/cpumask.h>
+#include <linux/string.h>
+#include <linux/fs.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include "aesd-stats.h"
+
+static const char *const aesd_stat_names[AESD_STAT_NR] = {
+    [AESD_STAT_WRITES] =             "writes",
+    [AESD_STAT_WRITE_BYTES] =        "write_bytes",
+    [AESD_STAT_COMMITS] =            "commits",
+    [AESD_STAT_EVICTIONS] =          "evictions",
+    [AESD_STAT_READS] =              "reads",
+    [AESD_STAT_READ_BYTES] =         "read_bytes",
+    [AESD_STAT_READ_RETRIES] =       "read_retries",
+    [AESD_STAT_PARK_DROPPED_BYTES] = "park_dropped_bytes",
+};
+
+static const char *const aesd_hist_names[AESD_HIST_NR] = {
+    [AESD_HIST_LOCK_WAIT] =       "lock_wait_ns",
+    [AESD_HIST_LOCK_HOLD] =       "lock_hold_ns",
+    [AESD_HIST_COPY_FROM_USER] =  "copy_from_user_ns",
+    [AESD_HIST_COPY_TO_USER] =    "copy_to_user_ns",
+};
+
+int aesd_stats_init(struct aesd_stats *stats)
+{
+    stats->cpu = alloc_percpu(struct aesd_stats_cpu);
+    return stats->cpu ? 0 : -ENOMEM;
+}
+
+void aesd_stats_exit(struct aesd_stats *stats)
+{
+    free_percpu(stats->cpu);
+    stats->cpu = NULL;
+}
+
+static int aesd_stats_show(struct seq_file *s, void *unused)
+{
+    struct aesd_stats *stats = s->private;
+    u64 counters[AESD_STAT_NR] = { 0 };
+    u64 hist[AESD_HIST_BUCKETS];
+    unsigned int i, bucket;
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        struct aesd_stats_cpu *stats_cpu = per_cpu_ptr(stats->cpu, cpu);
+
+        for (i = 0; i < AESD_STAT_NR; i++)
+            counters[i] += READ_ONCE(stats_cpu->counters[i]);
+    }
+    for (i = 0; i < AESD_STAT_NR; i++)
+        seq_printf(s, "%-18s %llu\n", aesd_stat_names[i], counters[i]);
+
+    for (i = 0; i < AESD_HIST_NR; i++) {
+        memset(hist, 0, sizeof(hist));
+        for_each_possible_cpu(cpu) {
+            struct aesd_stats_cpu *stats_cpu = per_cpu_ptr(stats->cpu, cpu);
+
+            for (bucket = 0; bucket < AESD_HIST_BUCKETS; bucket++)
+                hist[bucket] += READ_ONCE(stats_cpu->hist[i][bucket]);
+        }
+
+        seq_printf(s, "\n%s\n", aesd_hist_names[i]);
+        for (bucket = 0; bucket < AESD_HIST_BUCKETS; bucket++) {
+            if (hist[bucket])
+                seq_printf(s, "  >= %-12llu %llu\n", bucket ? 1ULL << bucket : 0ULL, hist[bucket]);
+        }
+    }
+    return 0;
+}
+
+static int aesd_stats_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, aesd_stats_show, inode->i_private);
+}
+
+/**
+ * Any write resets the statistics. Updates racing with the reset on other
+ * CPUs may survive it, which is fine for monitoring purposes.
+ */
+static ssize_t aesd_stats_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+    struct aesd_stats *stats = ((struct seq_file *)file->private_data)->private;
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+        memset(per_cpu_ptr(stats->cpu, cpu), 0, sizeof(struct aesd_stats_cpu));
+    return count;
+}
+
+static const struct file_operations aesd_stats_fops = {
+    .owner =   THIS_MODULE,
+    .open =    aesd_stats_open,
+    .read =    seq_read,
+    .write =   aesd_stats_write,
+    .llseek =  seq_lseek,
+    .release = single_release,
+};
+
+/**
+ * Expose @param stats as @param parent/stats
+ */
+void aesd_stats_debugfs_init(struct aesd_stats *stats, struct dentry *parent)
+{
+    debugfs_create_file("stats", 0644, parent, stats, &aesd_stats_fops);
+}
@@ -0,0 +1,95 @@
+/*
+ * aesd-stats.h
+ *
+ * @brief Per-device counters and latency histograms for aesdchar
+ */
+
+#ifndef AESD_STATS_H
+#define AESD_STATS_H
+
+#include <linux/types.h>
+#include <linux/percpu.h>
+#include <linux/log2.h>
+#include <linux/timekeeping.h>
+
+struct dentry;
+
+enum aesd_stat {
+    AESD_STAT_WRITES,
+    AESD_STAT_WRITE_BYTES,
+    AESD_STAT_COMMITS,
+    AESD_STAT_EVICTIONS,
+    AESD_STAT_READS,
+    AESD_STAT_READ_BYTES,
+    /**
+     * Lockless lookups repeated because a writer changed the ring meanwhile
+     */
+    AESD_STAT_READ_RETRIES,
+    /**
+     * Unterminated bytes of closed files lost because no block could hold them
+     */
+    AESD_STAT_PARK_DROPPED_BYTES,
+    AESD_STAT_NR
+};
+
+enum aesd_hist {
+    AESD_HIST_LOCK_WAIT,
+    AESD_HIST_LOCK_HOLD,
+    AESD_HIST_COPY_FROM_USER,
+    AESD_HIST_COPY_TO_USER,
+    AESD_HIST_NR
+};
+
+/**
+ * Bucket i counts samples of [2^i, 2^(i+1)) ns, the last one everything above
+ */
+#define AESD_HIST_BUCKETS 32
+
+struct aesd_stats_cpu
+{
+    u64 counters[AESD_STAT_NR];
+    u64 hist[AESD_HIST_NR][AESD_HIST_BUCKETS];
+};
+
+/**
+ * Kept per CPU so that counting never bounces a shared cache line between
+ * writers; the debugfs file sums over all CPUs when read.
+ */
+struct aesd_stats
+{
+    struct aesd_stats_cpu __percpu *cpu;
+};
+
+extern int aesd_stats_init(struct aesd_stats *stats);
+extern void aesd_stats_exit(struct aesd_stats *stats);
+extern void aesd_stats_debugfs_init(struct aesd_stats *stats, struct dentry *parent);
+
+static inline void aesd_stats_add(struct aesd_stats *stats, enum aesd_stat stat, u64 value)
+{
+    this_cpu_add(stats->cpu->counters[stat], value);
+}
+
+/**
+ * Record a latency of @param ns nanoseconds in histogram @param hist
+ */
+static inline void aesd_stats_record(struct aesd_stats *stats, enum aesd_hist hist, u64 ns)
+{
+    unsigned int bucket = ns ? ilog2(ns) : 0;
+
+    if (bucket >= AESD_HIST_BUCKETS)
+        bucket = AESD_HIST_BUCKETS - 1;
+    this_cpu_inc(stats->cpu->hist[hist][bucket]);
+}
+
+/**
+ * Record the time since @param start, a ktime_get_ns() value, and return the current time
+ */
+static inline u64 aesd_stats_record_since(struct aesd_stats *stats, enum aesd_hist hist, u64 start)
+{
+    u64 now = ktime_get_ns();
+
+    aesd_stats_record(stats, hist, now - start);
+    return now;
+}
+
+#endif /* AESD_STATS_H */
@@ -0,0 +1,152 @@
+/*
+ * aesd-trace.h
+ *
+ * @brief Tracepoints on the aesdchar hot paths
+ *
+ * Enable with e.g.
+ *   echo 1 > /sys/kernel/tracing/events/aesdchar/enable
+ * or perf record -e 'aesdchar:*', and summarize a capture with
+ * aesdchar_trace_summary. Disabled tracepoints cost a patched-out branch.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM aesdchar
+
+#if !defined(_AESD_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _AESD_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(aesd_commit,
+
+    TP_PROTO(unsigned int minor, size_t size, unsigned int entries, size_t total_size),
+
+    TP_ARGS(minor, size, entries, total_size),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(size_t, size)
+        __field(unsigned int, entries)
+        __field(size_t, total_size)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->size = size;
+        __entry->entries = entries;
+        __entry->total_size = total_size;
+    ),
+
+    TP_printk("minor=%u size=%zu entries=%u total_size=%zu",
+              __entry->minor, __entry->size, __entry->entries, __entry->total_size)
+);
+
+/*
+ * overwrite is 1 when the ring was full, 0 when the entry was evicted to stay
+ * within aesd_max_bytes
+ */
+TRACE_EVENT(aesd_evict,
+
+    TP_PROTO(unsigned int minor, size_t size, bool overwrite),
+
+    TP_ARGS(minor, size, overwrite),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(size_t, size)
+        __field(bool, overwrite)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->size = size;
+        __entry->overwrite = overwrite;
+    ),
+
+    TP_printk("minor=%u size=%zu overwrite=%d", __entry->minor, __entry->size, __entry->overwrite)
+);
+
+TRACE_EVENT(aesd_read,
+
+    TP_PROTO(unsigned int minor, loff_t pos, size_t count, ssize_t ret, bool follow),
+
+    TP_ARGS(minor, pos, count, ret, follow),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(loff_t, pos)
+        __field(size_t, count)
+        __field(ssize_t, ret)
+        __field(bool, follow)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->pos = pos;
+        __entry->count = count;
+        __entry->ret = ret;
+        __entry->follow = follow;
+    ),
+
+    TP_printk("minor=%u pos=%lld count=%zu ret=%zd follow=%d",
+              __entry->minor, __entry->pos, __entry->count, __entry->ret, __entry->follow)
+);
+
+TRACE_EVENT(aesd_llseek,
+
+    TP_PROTO(unsigned int minor, loff_t offset, int whence, loff_t ret),
+
+    TP_ARGS(minor, offset, whence, ret),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(loff_t, offset)
+        __field(int, whence)
+        __field(loff_t, ret)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->offset = offset;
+        __entry->whence = whence;
+        __entry->ret = ret;
+    ),
+
+    TP_printk("minor=%u offset=%lld whence=%d ret=%lld",
+              __entry->minor, __entry->offset, __entry->whence, __entry->ret)
+);
+
+TRACE_EVENT(aesd_seekto,
+
+    TP_PROTO(unsigned int minor, u32 write_cmd, u32 write_cmd_offset, long ret, loff_t pos),
+
+    TP_ARGS(minor, write_cmd, write_cmd_offset, ret, pos),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(u32, write_cmd)
+        __field(u32, write_cmd_offset)
+        __field(long, ret)
+        __field(loff_t, pos)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->write_cmd = write_cmd;
+        __entry->write_cmd_offset = write_cmd_offset;
+        __entry->ret = ret;
+        __entry->pos = pos;
+    ),
+
+    TP_printk("minor=%u write_cmd=%u write_cmd_offset=%u ret=%ld pos=%lld",
+              __entry->minor, __entry->write_cmd, __entry->write_cmd_offset, __entry->ret, __entry->pos)
+);
+
+#endif /* _AESD_TRACE_H */
+
+/* This part must be outside the include guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE aesd-trace
+#include <trace/define_trace.h>
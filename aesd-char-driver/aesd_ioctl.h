@@ -33,14 +33,197 @@ struct aesd_seekto {
     uint32_t write_cmd_offset;
 };
 
+/**
+ * Describes one write command inside a snapshot mapped with mmap()
+ */
+struct aesd_entry_info {
+    /**
+     * Byte offset of the write command from the start of the mapping
+     */
+    uint64_t offset;
+    /**
+     * Length of the write command in bytes
+     */
+    uint64_t size;
+};
+
+/**
+ * Passed with AESDCHAR_IOCSNAPSHOT. The ioctl captures the current contents
+ * of the device into a read-only snapshot which a following mmap() of the
+ * same file descriptor maps, and reports where each write command starts.
+ */
+struct aesd_snapshot_info {
+    /**
+     * In: user address of an array of struct aesd_entry_info to fill, or 0
+     */
+    uint64_t entries;
+    /**
+     * In: number of elements available at entries
+     */
+    uint32_t max_entries;
+    /**
+     * Out: number of write commands in the snapshot. Only the first
+     * max_entries of them are copied to entries.
+     */
+    uint32_t num_entries;
+    /**
+     * Out: number of bytes in the snapshot, the length to pass to mmap()
+     */
+    uint64_t size;
+};
+
+/**
+ * Passed with AESDCHAR_IOCWRITEBATCH. The buffer holds any number of write
+ * commands back to back, each terminated by a newline. They are committed
+ * as one update, exactly as if written one by one with write() on the same
+ * file descriptor: the first one completes its pending partial write, and
+ * bytes after the last newline are kept as the next partial write.
+ */
+struct aesd_write_batch {
+    /**
+     * In: user address of the commands
+     */
+    uint64_t buf;
+    /**
+     * In: number of bytes at buf
+     */
+    uint64_t len;
+    /**
+     * Out: number of write commands committed
+     */
+    uint32_t accepted;
+    /**
+     * Out: number of older write commands evicted or overwritten to make room,
+     * including commands of this batch if it holds more than the device keeps
+     */
+    uint32_t evicted;
+};
+
+/**
+ * Start of the image produced by AESDCHAR_IOCSAVE and loaded by
+ * AESDCHAR_IOCRESTORE. It is followed by num_entries uint32_t entry sizes,
+ * then the entries back to back, oldest first, then parked_size bytes of the
+ * unterminated write left by a closed file. Fields are in host byte order.
+ */
+struct aesd_image_header {
+    /**
+     * AESD_IMAGE_MAGIC
+     */
+    uint32_t magic;
+    /**
+     * AESD_IMAGE_VERSION
+     */
+    uint32_t version;
+    uint32_t num_entries;
+    uint32_t parked_size;
+    /**
+     * Sum of the entry sizes
+     */
+    uint64_t data_size;
+};
+
+#define AESD_IMAGE_MAGIC 0x64736561 /* "aesd" */
+#define AESD_IMAGE_VERSION 1
+
+/**
+ * Passed with AESDCHAR_IOCSAVE and AESDCHAR_IOCRESTORE
+ */
+struct aesd_image {
+    /**
+     * In: user address of the image
+     */
+    uint64_t buf;
+    /**
+     * In: bytes available at buf for AESDCHAR_IOCSAVE, bytes of the image
+     * for AESDCHAR_IOCRESTORE
+     */
+    uint64_t len;
+    /**
+     * Out: bytes of the image. AESDCHAR_IOCSAVE only copies it to buf when it
+     * fits in len, otherwise call again with a larger buffer.
+     */
+    uint64_t size;
+    /**
+     * Out: number of write commands in the image
+     */
+    uint32_t num_entries;
+    /**
+     * Out: number of write commands AESDCHAR_IOCRESTORE dropped, the previous
+     * history plus commands of the image beyond what the device keeps
+     */
+    uint32_t evicted;
+};
+
+/**
+ * Longest pattern AESDCHAR_IOCSEARCH accepts
+ */
+#define AESD_SEARCH_MAX_PATTERN 4096
+
+/**
+ * Only match at the first byte of a write command
+ */
+#define AESD_SEARCH_PREFIX 0x1
+
+/**
+ * Passed with AESDCHAR_IOCSEARCH. Every occurrence of the pattern inside a
+ * write command is reported, oldest first, as the position AESDCHAR_IOCSEEKTO
+ * takes to read from it. Matches never span two write commands.
+ */
+struct aesd_search {
+    /**
+     * In: user address of the bytes to look for
+     */
+    uint64_t pattern;
+    /**
+     * In: number of bytes at pattern, 1 to AESD_SEARCH_MAX_PATTERN
+     */
+    uint32_t pattern_len;
+    /**
+     * In: AESD_SEARCH_PREFIX or 0
+     */
+    uint32_t flags;
+    /**
+     * In: user address of an array of struct aesd_seekto to fill, or 0
+     */
+    uint64_t results;
+    /**
+     * In: number of elements available at results
+     */
+    uint32_t max_results;
+    /**
+     * Out: number of matches. Only the first max_results of them are copied
+     * to results.
+     */
+    uint32_t num_results;
+};
+
 // Pick an arbitrary unused value from https://github.com/torvalds/linux/blob/master/Documentation/userspace-api/ioctl/ioctl-number.rst
 #define AESD_IOC_MAGIC 0x16
 
 // Define a write command from the user point of view, use command number 1
 #define AESDCHAR_IOCSEEKTO _IOWR(AESD_IOC_MAGIC, 1, struct aesd_seekto)
+// Capture a snapshot for mmap() and return its entry boundary table
+#define AESDCHAR_IOCSNAPSHOT _IOWR(AESD_IOC_MAGIC, 2, struct aesd_snapshot_info)
+/**
+ * Pass a nonzero uint32_t to make reads on this file descriptor follow new
+ * writes like tail -f: read() blocks at the end of the data (unless O_NONBLOCK
+ * is set, then it fails with EAGAIN) and poll() reports new entries. If the
+ * reader falls behind far enough for unread entries to be overwritten, the
+ * next read() fails once with EPIPE and reading resumes at the oldest entry.
+ * Pass zero to return to normal reads.
+ */
+#define AESDCHAR_IOCFOLLOW _IOW(AESD_IOC_MAGIC, 3, uint32_t)
+// Commit several write commands with one syscall and one lock acquisition
+#define AESDCHAR_IOCWRITEBATCH _IOWR(AESD_IOC_MAGIC, 4, struct aesd_write_batch)
+// Copy the whole history, with entry boundaries, out as one image
+#define AESDCHAR_IOCSAVE _IOWR(AESD_IOC_MAGIC, 5, struct aesd_image)
+// Replace the whole history with a saved image, under one lock acquisition
+#define AESDCHAR_IOCRESTORE _IOWR(AESD_IOC_MAGIC, 6, struct aesd_image)
+// Locate the write commands holding a pattern, without copying the history out
+#define AESDCHAR_IOCSEARCH _IOWR(AESD_IOC_MAGIC, 7, struct aesd_search)
 /**
  * The maximum number of commands supported, used for bounds checking
  */
-#define AESDCHAR_IOC_MAXNR 1
+#define AESDCHAR_IOC_MAXNR 7
 
 #endif /* AESD_IOCTL_H */
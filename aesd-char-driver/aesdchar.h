@@ -10,7 +10,15 @@
 
 #include <linux/mutex.h>           // For struct mutex
 #include <linux/cdev.h>            // For struct cdev
+#include <linux/seqlock.h>         // For seqcount_mutex_t
+#include <linux/srcu.h>            // For struct srcu_struct
+#include <linux/kref.h>            // For struct kref
+#include <linux/wait.h>            // For wait_queue_head_t
+#include <linux/poll.h>            // For poll_table
 #include "aesd-circular-buffer.h"  // For struct aesd_circular_buffer
+#include "aesd_ioctl.h"            // For struct aesd_entry_info
+#include "aesd-entry-pool.h"       // For struct aesd_entry_block
+#include "aesd-stats.h"            // For struct aesd_stats
 
 #define AESD_DEBUG 1  
 
@@ -29,21 +37,94 @@
 struct aesd_dev
 {
     struct aesd_circular_buffer buffer;
-    char *partial_entry_ptr;
-    size_t partial_entry_size;
+    /**
+     * Unterminated write left behind by a file closed before its newline.
+     * The next entry committed on any file is appended to it, which keeps
+     * the result of a write split across several opens the same as before.
+     */
+    struct aesd_entry_block *parked_entry;
+    size_t parked_entry_size;
+    /**
+     * Serializes commits to buffer and protects parked_entry. Readers never take it.
+     */
     struct mutex lock;
+    /**
+     * Bumped by writers around every change to buffer, so readers can take a
+     * consistent snapshot of an entry and retry if they raced with a writer.
+     */
+    seqcount_mutex_t seq;
+    /**
+     * Keeps entry memory alive while readers copy_to_user() from it.
+     */
+    struct srcu_struct srcu;
+    /**
+     * Woken whenever an entry is committed, for poll() and follow mode readers
+     */
+    wait_queue_head_t wq;
+    struct aesd_stats stats;
     struct cdev cdev;
 };
 
+/**
+ * A read-only copy of the device contents, shared by the file that captured
+ * it and every vma mapping it.
+ */
+struct aesd_snapshot
+{
+    struct kref ref;
+    /**
+     * vmalloc_user() memory holding the entries back to back, NULL if empty
+     */
+    void *data;
+    size_t size;
+    struct aesd_entry_info *entries;
+    unsigned int num_entries;
+};
+
+/**
+ * Per open file state, stored in filp->private_data
+ */
+struct aesd_file
+{
+    struct aesd_dev *dev;
+    /**
+     * Protects snapshot
+     */
+    struct mutex lock;
+    /**
+     * Latest snapshot captured by AESDCHAR_IOCSNAPSHOT or mmap(), or NULL
+     */
+    struct aesd_snapshot *snapshot;
+    /**
+     * Set by AESDCHAR_IOCFOLLOW: reads block at the end of the data and track
+     * follow_pos, a stream offset (see aesd_buffer_entry.start), so entries
+     * being overwritten do not shift what this reader sees next.
+     */
+    bool follow;
+    size_t follow_pos;
+    /**
+     * Serializes writers on this file and protects the staging buffer below
+     */
+    struct mutex write_lock;
+    /**
+     * Bytes written to this file since its last newline. They are built up
+     * here without dev->lock, which is only taken to commit a whole entry.
+     */
+    struct aesd_entry_block *partial_entry;
+    size_t partial_entry_size;
+};
+
 extern struct file_operations aesd_fops;
 
 // Function prototypes for file operations
 int aesd_open(struct inode *inode, struct file *filp);
 int aesd_release(struct inode *inode, struct file *filp);
-ssize_t aesd_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos);
+ssize_t aesd_read_iter(struct kiocb *iocb, struct iov_iter *to);
 ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos);
 loff_t aesd_llseek(struct file *filp, loff_t offset, int whence);
 long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+int aesd_mmap(struct file *filp, struct vm_area_struct *vma);
+__poll_t aesd_poll(struct file *filp, poll_table *wait);
 long aesd_adjust_file_offset(struct file *filp, uint32_t write_cmd, uint32_t write_cmd_offset);
 
 #endif /* AESD_CHAR_DRIVER_AESDCHAR_H_ */
@@ -11,227 +11,1348 @@
 #include <linux/fs.h> 
 #include <linux/slab.h>
 #include <linux/uaccess.h>
+#include <linux/uio.h>
+#include <linux/version.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/poll.h>
+#include <linux/sched.h>
+#include <linux/wait.h>
+#include <linux/debugfs.h>
 #include "aesdchar.h"
 #include "aesd-circular-buffer.h"
+#include "aesd-entry-pool.h"
+#include "aesd-stats.h"
 #include "aesd_ioctl.h"
 
+#define CREATE_TRACE_POINTS
+#include "aesd-trace.h"
+
 int aesd_major =   0;
 int aesd_minor =   0;
 
+static unsigned int aesd_max_entries = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+module_param(aesd_max_entries, uint, 0444);
+MODULE_PARM_DESC(aesd_max_entries, "Number of write commands kept in the history (power of two avoids a divide)");
+
+static unsigned long aesd_max_bytes;
+module_param(aesd_max_bytes, ulong, 0444);
+MODULE_PARM_DESC(aesd_max_bytes, "Evict the oldest write commands to keep the history under this many bytes, 0 for no limit");
+
+static unsigned int aesd_nr_devices = 1;
+module_param(aesd_nr_devices, uint, 0444);
+MODULE_PARM_DESC(aesd_nr_devices, "Number of independent devices, each with its own history and lock");
+
 MODULE_AUTHOR("happysmaran");
 MODULE_LICENSE("Dual BSD/GPL");
 
-struct aesd_dev aesd_device;
+// aesd_nr_devices devices, minor aesd_minor + i is aesd_devices[i]
+static struct aesd_dev *aesd_devices;
+static struct dentry *aesd_debugfs_root;
+
+static inline struct aesd_dev *aesd_file_dev(struct file *filp)
+{
+    return ((struct aesd_file *)filp->private_data)->dev;
+}
+
+static inline unsigned int aesd_dev_minor(struct aesd_dev *dev)
+{
+    return MINOR(dev->cdev.dev);
+}
+
+static void aesd_snapshot_release(struct kref *ref)
+{
+    struct aesd_snapshot *snapshot = container_of(ref, struct aesd_snapshot, ref);
+
+    vfree(snapshot->data);
+    kvfree(snapshot->entries);
+    kfree(snapshot);
+}
+
+static void aesd_snapshot_put(struct aesd_snapshot *snapshot)
+{
+    if (snapshot)
+        kref_put(&snapshot->ref, aesd_snapshot_release);
+}
 
 int aesd_open(struct inode *inode, struct file *filp)
 {
-    struct aesd_dev *dev;
-    dev = container_of(inode->i_cdev, struct aesd_dev, cdev);
-    filp->private_data = dev;
+    struct aesd_file *file;
+
+    file = kzalloc(sizeof(*file), GFP_KERNEL);
+    if (!file)
+        return -ENOMEM;
+    file->dev = container_of(inode->i_cdev, struct aesd_dev, cdev);
+    mutex_init(&file->lock);
+    mutex_init(&file->write_lock);
+    filp->private_data = file;
     return 0;
 }
 
+/**
+ * Take dev->lock, recording how long that took.
+ * @return the time it was acquired, to pass to aesd_dev_unlock()
+ */
+static u64 aesd_dev_lock(struct aesd_dev *dev)
+{
+    u64 start = ktime_get_ns();
+
+    mutex_lock(&dev->lock);
+    return aesd_stats_record_since(&dev->stats, AESD_HIST_LOCK_WAIT, start);
+}
+
+static void aesd_dev_unlock(struct aesd_dev *dev, u64 locked)
+{
+    aesd_stats_record_since(&dev->stats, AESD_HIST_LOCK_HOLD, locked);
+    mutex_unlock(&dev->lock);
+}
+
+/**
+ * Hand the unterminated write of a closing file over to the device, so the
+ * next commit on any file completes it. Appending to a write already parked
+ * may need a larger block: it is allocated with dev->lock dropped, then the
+ * parked size is checked again since it may have grown or been committed
+ * meanwhile, so the append itself cannot fail under the lock.
+ */
+static void aesd_park_partial(struct aesd_dev *dev, struct aesd_file *file)
+{
+    struct aesd_entry_block *spare = NULL;
+    size_t needed;
+    u64 locked;
+
+    locked = aesd_dev_lock(dev);
+    while (dev->parked_entry &&
+           (needed = dev->parked_entry_size + file->partial_entry_size) > dev->parked_entry->capacity &&
+           (!spare || needed > spare->capacity)) {
+        aesd_dev_unlock(dev, locked);
+        aesd_entry_block_free(spare);
+        spare = aesd_entry_block_alloc(needed);
+        if (!spare) {
+            aesd_stats_add(&dev->stats, AESD_STAT_PARK_DROPPED_BYTES, file->partial_entry_size);
+            pr_warn_ratelimited("aesdchar%u: dropped %zu unterminated bytes of a closed file, out of memory\n",
+                                aesd_dev_minor(dev), file->partial_entry_size);
+            return;
+        }
+        locked = aesd_dev_lock(dev);
+    }
+
+    if (!dev->parked_entry) {
+        dev->parked_entry = file->partial_entry;
+        dev->parked_entry_size = file->partial_entry_size;
+        file->partial_entry = NULL;
+    } else {
+        if (dev->parked_entry_size + file->partial_entry_size > dev->parked_entry->capacity) {
+            // Readers never see the parked write, the old block can go right away
+            memcpy(spare->data, dev->parked_entry->data, dev->parked_entry_size);
+            swap(dev->parked_entry, spare);
+        }
+        memcpy(dev->parked_entry->data + dev->parked_entry_size, file->partial_entry->data,
+               file->partial_entry_size);
+        dev->parked_entry_size += file->partial_entry_size;
+    }
+    aesd_dev_unlock(dev, locked);
+    aesd_entry_block_free(spare);
+}
+
 int aesd_release(struct inode *inode, struct file *filp)
 {
+    struct aesd_file *file = filp->private_data;
+
+    if (file->partial_entry_size)
+        aesd_park_partial(file->dev, file);
+    aesd_entry_block_free(file->partial_entry);
+    aesd_snapshot_put(file->snapshot);
+    mutex_destroy(&file->write_lock);
+    mutex_destroy(&file->lock);
+    kfree(file);
     return 0;
 }
 
-ssize_t aesd_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
+/**
+ * Snapshot the stream offsets of the oldest byte and one past the newest
+ * byte currently stored, see aesd_buffer_entry.start.
+ */
+static void aesd_stream_window(struct aesd_dev *dev, size_t *start, size_t *end)
+{
+    unsigned int seq;
+
+    do {
+        seq = read_seqcount_begin(&dev->seq);
+        *start = dev->buffer.start_offset;
+        *end = *start + aesd_circular_buffer_total_size(&dev->buffer);
+    } while (read_seqcount_retry(&dev->seq, seq));
+}
+
+/**
+ * @return true if a follower at stream offset @pos has something to read,
+ *      either new data or an -EPIPE to report.
+ */
+static bool aesd_follow_ready(struct aesd_dev *dev, size_t pos)
+{
+    size_t start, end;
+
+    aesd_stream_window(dev, &start, &end);
+    return end != pos;
+}
+
+/**
+ * Entries snapshotted per pass of the seqcount read section in
+ * aesd_read_entries(), bounding the stack used and the work a writer can
+ * force a reader to retry.
+ */
+#define AESD_READ_BATCH 8
+
+/**
+ * Copy from the entry containing @pos on into @to, across as many
+ * consecutive entries as fit, without taking dev->lock.
+ * @param pos offset to read from, relative to the oldest entry or, when
+ *      @stream_pos is true, a stream offset (see aesd_buffer_entry.start).
+ * @param start_rtn set to the stream offset of the oldest entry seen.
+ * @return bytes copied, 0 at the end of the data, -EPIPE when the stream
+ *      offset @pos has already been overwritten, or -EFAULT.
+ */
+static ssize_t aesd_read_entries(struct aesd_dev *dev, size_t pos, bool stream_pos,
+                                 struct iov_iter *to, size_t *start_rtn)
 {
-    struct aesd_dev *dev = filp->private_data;
     struct aesd_buffer_entry *entry;
-    size_t entry_offset_byte_rtn = 0;
+    struct aesd_buffer_entry batch[AESD_READ_BATCH];
+    size_t first_offset = 0, oldest, wanted, bytes_to_copy, copied;
     ssize_t retval = 0;
+    bool lagged, first_pass = true;
+    unsigned int seq, tries, nr_entries, i;
+    u64 start;
+    int idx;
 
-    if (mutex_lock_interruptible(&dev->lock))
-        return -ERESTARTSYS;
+    /*
+     * Lockless lookup: SRCU keeps any buffptr we observe alive until
+     * srcu_read_unlock(), and the seqcount makes us retry if a writer
+     * changed the ring while we were walking it. After the first pass @pos
+     * is a stream offset, so an eviction between passes cannot make the
+     * read skip or repeat bytes.
+     */
+    idx = srcu_read_lock(&dev->srcu);
+    while (iov_iter_count(to)) {
+        tries = 0;
+        do {
+            tries++;
+            seq = read_seqcount_begin(&dev->seq);
+            oldest = dev->buffer.start_offset;
+            nr_entries = 0;
+            lagged = (stream_pos || !first_pass) && (ssize_t)(oldest - pos) > 0;
+            if (lagged)
+                continue;
+
+            entry = aesd_circular_buffer_find_entry_offset_for_fpos(&dev->buffer,
+                        stream_pos || !first_pass ? pos - oldest : pos, &first_offset);
+            wanted = iov_iter_count(to) + first_offset;
+            while (entry && nr_entries < AESD_READ_BATCH) {
+                batch[nr_entries++] = *entry;
+                if (entry->size >= wanted)
+                    break;
+                wanted -= entry->size;
+                entry = aesd_circular_buffer_find_entry_offset_for_fpos(&dev->buffer,
+                            entry->start + entry->size - oldest, NULL);
+            }
+        } while (read_seqcount_retry(&dev->seq, seq));
+        if (tries > 1)
+            aesd_stats_add(&dev->stats, AESD_STAT_READ_RETRIES, tries - 1);
+
+        if (first_pass) {
+            *start_rtn = oldest;
+            if (!stream_pos)
+                pos += oldest;
+            first_pass = false;
+        }
+        if (lagged) {
+            // Overwritten since the previous pass, return what was read so far
+            if (!retval)
+                retval = -EPIPE;
+            break;
+        }
+        if (!nr_entries)
+            break;
+
+        start = ktime_get_ns();
+        for (i = 0; i < nr_entries; i++) {
+            bytes_to_copy = min(batch[i].size - first_offset, iov_iter_count(to));
+            copied = copy_to_iter(batch[i].buffptr + first_offset, bytes_to_copy, to);
+            retval += copied;
+            pos += copied;
+            first_offset = 0;
+            if (copied < bytes_to_copy) {
+                if (!retval)
+                    retval = -EFAULT;
+                break;
+            }
+        }
+        aesd_stats_record_since(&dev->stats, AESD_HIST_COPY_TO_USER, start);
+        if (retval < 0 || i < nr_entries || nr_entries < AESD_READ_BATCH)
+            break;
+    }
+    srcu_read_unlock(&dev->srcu, idx);
+    return retval;
+}
 
-    entry = aesd_circular_buffer_find_entry_offset_for_fpos(&dev->buffer, *f_pos, &entry_offset_byte_rtn);
+/**
+ * tail -f style read for files with AESDCHAR_IOCFOLLOW enabled: block at the
+ * end of the data until a writer commits an entry, and report -EPIPE once
+ * (like /dev/kmsg) if entries were overwritten before this reader saw them,
+ * resuming at the oldest entry still stored.
+ * Like f_pos, follow_pos is not serialized between concurrent readers of one file.
+ */
+static ssize_t aesd_read_follow(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct aesd_file *file = iocb->ki_filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    size_t start;
+    ssize_t retval;
 
-    if (entry == NULL) {
-        mutex_unlock(&dev->lock);
-        return 0; 
+    if (!iov_iter_count(to))
+        return 0;
+
+    while ((retval = aesd_read_entries(dev, file->follow_pos, true, to, &start)) == 0) {
+        if ((iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT))
+            return -EAGAIN;
+        if (wait_event_interruptible(dev->wq, aesd_follow_ready(dev, file->follow_pos)))
+            return -ERESTARTSYS;
     }
 
-    size_t remaining_in_entry = entry->size - entry_offset_byte_rtn;
-    size_t bytes_to_copy = (remaining_in_entry < count) ? remaining_in_entry : count;
+    if (retval == -EPIPE) {
+        file->follow_pos = start;
+        iocb->ki_pos = 0;
+    } else if (retval > 0) {
+        file->follow_pos += retval;
+        iocb->ki_pos = file->follow_pos - start;
+    }
+    return retval;
+}
 
-    if (copy_to_user(buf, entry->buffptr + entry_offset_byte_rtn, bytes_to_copy)) {
-        retval = -EFAULT;
+/**
+ * Serves read(), readv() and, through the generic splice helpers, splice()
+ * and sendfile() so a reply can be streamed into a socket without a bounce
+ * through userspace. Each call fills the whole iterator across as many
+ * entries as are stored, so dumping the history takes one call per buffer
+ * rather than one per entry.
+ */
+ssize_t aesd_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct aesd_file *file = iocb->ki_filp->private_data;
+    loff_t pos = file->follow ? file->follow_pos : iocb->ki_pos;
+    size_t count = iov_iter_count(to);
+    size_t start;
+    ssize_t retval;
+
+    if (file->follow) {
+        retval = aesd_read_follow(iocb, to);
     } else {
-        retval = bytes_to_copy;
-        *f_pos += bytes_to_copy;
+        retval = aesd_read_entries(file->dev, iocb->ki_pos, false, to, &start);
+        if (retval > 0)
+            iocb->ki_pos += retval;
     }
 
-    mutex_unlock(&dev->lock);
+    trace_aesd_read(aesd_dev_minor(file->dev), pos, count, retval, file->follow);
+    aesd_stats_add(&file->dev->stats, AESD_STAT_READS, 1);
+    if (retval > 0)
+        aesd_stats_add(&file->dev->stats, AESD_STAT_READ_BYTES, retval);
     return retval;
 }
 
+/**
+ * Readable when there is data past the file position (the follow position in
+ * follow mode), with EPOLLPRI added when a follower has been overwritten.
+ */
+__poll_t aesd_poll(struct file *filp, poll_table *wait)
+{
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    __poll_t mask = EPOLLOUT | EPOLLWRNORM;
+    size_t start, end, pos;
+
+    poll_wait(filp, &dev->wq, wait);
+
+    aesd_stream_window(dev, &start, &end);
+    pos = file->follow ? file->follow_pos : start + filp->f_pos;
+    if ((ssize_t)(start - pos) > 0)
+        mask |= EPOLLIN | EPOLLRDNORM | EPOLLPRI;
+    else if (pos != end)
+        mask |= EPOLLIN | EPOLLRDNORM;
+    return mask;
+}
+
+/**
+ * Recycle an entry removed from the circular buffer once every reader that
+ * might have looked it up has left its SRCU read-side critical section.
+ */
+static void aesd_entry_free_deferred(struct aesd_dev *dev, const char *buffptr)
+{
+    aesd_entry_block_free_deferred(&dev->srcu, aesd_entry_block_of(buffptr));
+}
+
+/**
+ * Publish a completed entry to readers, first evicting the oldest entries as
+ * needed to stay within aesd_max_bytes. Must be called with dev->lock held,
+ * inside a write_seqcount section.
+ * @return the number of entries evicted or overwritten.
+ */
+static unsigned int aesd_commit_entry(struct aesd_dev *dev, const char *buffptr, size_t size)
+{
+    struct aesd_buffer_entry new_entry;
+    const char *overwritten_ptr;
+    unsigned int evicted = 0;
+
+    new_entry.buffptr = buffptr;
+    new_entry.size = size;
+
+    while (aesd_max_bytes && aesd_circular_buffer_count(&dev->buffer) &&
+           aesd_circular_buffer_total_size(&dev->buffer) + size > aesd_max_bytes) {
+        if (trace_aesd_evict_enabled())
+            trace_aesd_evict(aesd_dev_minor(dev), aesd_circular_buffer_get_entry(&dev->buffer, 0, NULL)->size,
+                             false);
+        aesd_entry_free_deferred(dev, aesd_circular_buffer_remove_oldest(&dev->buffer));
+        evicted++;
+    }
+    if (dev->buffer.full && trace_aesd_evict_enabled())
+        trace_aesd_evict(aesd_dev_minor(dev), aesd_circular_buffer_get_entry(&dev->buffer, 0, NULL)->size, true);
+    overwritten_ptr = aesd_circular_buffer_add_entry(&dev->buffer, &new_entry);
+    if (overwritten_ptr) {
+        aesd_entry_free_deferred(dev, overwritten_ptr);
+        evicted++;
+    }
+    trace_aesd_commit(aesd_dev_minor(dev), size, aesd_circular_buffer_count(&dev->buffer),
+                      aesd_circular_buffer_total_size(&dev->buffer));
+
+    return evicted;
+}
+
+/**
+ * Prepend the parked write, if any, to the entry about to be committed.
+ * Must be called with dev->lock held.
+ * @return the block to commit, or NULL if it could not be grown.
+ */
+static struct aesd_entry_block *aesd_adopt_parked(struct aesd_dev *dev, struct aesd_entry_block *block,
+                                                  size_t *size)
+{
+    struct aesd_entry_block *new_block;
+
+    if (!dev->parked_entry)
+        return block;
+
+    new_block = aesd_entry_block_grow(dev->parked_entry, dev->parked_entry_size,
+                                      dev->parked_entry_size + *size);
+    if (!new_block)
+        return NULL;
+    memcpy(new_block->data + dev->parked_entry_size, block->data, *size);
+    *size += dev->parked_entry_size;
+    aesd_entry_block_free(block);
+    dev->parked_entry = NULL;
+    dev->parked_entry_size = 0;
+    return new_block;
+}
+
 ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos)
 {
-    struct aesd_dev *dev = filp->private_data;
-    char *new_data;
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    struct aesd_entry_block *new_block;
+    unsigned int evicted;
+    size_t size;
     ssize_t retval = count;
+    u64 start, locked;
 
-    if (mutex_lock_interruptible(&dev->lock))
+    if (mutex_lock_interruptible(&file->write_lock))
         return -ERESTARTSYS;
 
-    new_data = krealloc(dev->partial_entry_ptr, dev->partial_entry_size + count, GFP_KERNEL);
-    if (!new_data) {
-        mutex_unlock(&dev->lock);
-        return -ENOMEM;
+    new_block = aesd_entry_block_grow(file->partial_entry, file->partial_entry_size,
+                                      file->partial_entry_size + count);
+    if (!new_block) {
+        retval = -ENOMEM;
+        goto out;
     }
-    dev->partial_entry_ptr = new_data;
+    file->partial_entry = new_block;
 
-    if (copy_from_user(dev->partial_entry_ptr + dev->partial_entry_size, buf, count)) {
+    start = ktime_get_ns();
+    if (copy_from_user(file->partial_entry->data + file->partial_entry_size, buf, count)) {
         retval = -EFAULT;
-    } else {
-        dev->partial_entry_size += count;
-        if (dev->partial_entry_ptr[dev->partial_entry_size - 1] == '\n') {
-            struct aesd_buffer_entry new_entry;
-            new_entry.buffptr = dev->partial_entry_ptr;
-            new_entry.size = dev->partial_entry_size;
-
-            const char *overwritten_ptr = aesd_circular_buffer_add_entry(&dev->buffer, &new_entry);
-            if (overwritten_ptr) {
-                kfree(overwritten_ptr);
-            }
+        goto out;
+    }
+    aesd_stats_record_since(&dev->stats, AESD_HIST_COPY_FROM_USER, start);
+    aesd_stats_add(&dev->stats, AESD_STAT_WRITES, 1);
+    aesd_stats_add(&dev->stats, AESD_STAT_WRITE_BYTES, count);
+    file->partial_entry_size += count;
+    if (!count || file->partial_entry->data[file->partial_entry_size - 1] != '\n')
+        goto out;
 
-            dev->partial_entry_ptr = NULL;
-            dev->partial_entry_size = 0;
-        }
+    // Only publishing the finished entry needs the device lock
+    size = file->partial_entry_size;
+    locked = aesd_dev_lock(dev);
+    new_block = aesd_adopt_parked(dev, file->partial_entry, &size);
+    if (!new_block) {
+        aesd_dev_unlock(dev, locked);
+        file->partial_entry_size -= count;
+        retval = -ENOMEM;
+        goto out;
     }
+    write_seqcount_begin(&dev->seq);
+    evicted = aesd_commit_entry(dev, new_block->data, size);
+    write_seqcount_end(&dev->seq);
+    aesd_dev_unlock(dev, locked);
+    aesd_stats_add(&dev->stats, AESD_STAT_COMMITS, 1);
+    aesd_stats_add(&dev->stats, AESD_STAT_EVICTIONS, evicted);
 
-    mutex_unlock(&dev->lock);
+    file->partial_entry = NULL;
+    file->partial_entry_size = 0;
+    wake_up_interruptible(&dev->wq);
+
+out:
+    mutex_unlock(&file->write_lock);
     return retval;
 }
 
 loff_t aesd_llseek(struct file *filp, loff_t offset, int whence)
 {
-    struct aesd_dev *dev = filp->private_data;
-    loff_t total_size = 0;
+    struct aesd_dev *dev = aesd_file_dev(filp);
+    loff_t total_size, retval;
+    unsigned int seq;
+
+    do {
+        seq = read_seqcount_begin(&dev->seq);
+        total_size = aesd_circular_buffer_total_size(&dev->buffer);
+    } while (read_seqcount_retry(&dev->seq, seq));
+
+    retval = fixed_size_llseek(filp, offset, whence, total_size);
+    trace_aesd_llseek(aesd_dev_minor(dev), offset, whence, retval);
+    return retval;
+}
+
+long aesd_adjust_file_offset(struct file *filp, uint32_t write_cmd, uint32_t write_cmd_offset)
+{
+    struct aesd_dev *dev = aesd_file_dev(filp);
     struct aesd_buffer_entry *entry;
-    uint8_t index;
-    loff_t retval;
+    size_t entry_offset = 0;
+    size_t entry_size = 0;
+    unsigned int seq;
 
-    if (mutex_lock_interruptible(&dev->lock))
-        return -ERESTARTSYS;
+    do {
+        seq = read_seqcount_begin(&dev->seq);
+        // The test sends 0-indexed commands relative to current contents
+        entry = aesd_circular_buffer_get_entry(&dev->buffer, write_cmd, &entry_offset);
+        if (entry)
+            entry_size = entry->size;
+    } while (read_seqcount_retry(&dev->seq, seq));
 
-    AESD_CIRCULAR_BUFFER_FOREACH(entry, &dev->buffer, index) {
-        total_size += entry->size;
+    if (!entry || write_cmd_offset >= entry_size)
+        return -EINVAL;
+
+    // Start of the requested command, from the cached prefix sums, plus the internal offset
+    filp->f_pos = entry_offset + write_cmd_offset;
+    return 0;
+}
+
+/**
+ * Copy the current contents of the device into a new snapshot. Like reads,
+ * this runs without dev->lock: the entry descriptors are copied under the
+ * seqcount and the data under SRCU.
+ */
+static struct aesd_snapshot *aesd_snapshot_capture(struct aesd_dev *dev)
+{
+    struct aesd_snapshot *snapshot;
+    struct aesd_buffer_entry *ring;
+    struct aesd_buffer_entry *entry;
+    unsigned int count, i;
+    unsigned int seq;
+    size_t size;
+    int idx;
+
+    snapshot = kzalloc(sizeof(*snapshot), GFP_KERNEL);
+    ring = kvmalloc_array(dev->buffer.capacity, sizeof(*ring), GFP_KERNEL);
+    if (!snapshot || !ring)
+        goto nomem;
+    snapshot->entries = kvmalloc_array(dev->buffer.capacity, sizeof(*snapshot->entries), GFP_KERNEL);
+    if (!snapshot->entries)
+        goto nomem;
+    kref_init(&snapshot->ref);
+
+    idx = srcu_read_lock(&dev->srcu);
+    do {
+        seq = read_seqcount_begin(&dev->seq);
+        count = 0;
+        size = 0;
+        while ((entry = aesd_circular_buffer_get_entry(&dev->buffer, count, NULL)) != NULL) {
+            ring[count++] = *entry;
+            size += entry->size;
+        }
+    } while (read_seqcount_retry(&dev->seq, seq));
+
+    if (size) {
+        snapshot->data = vmalloc_user(PAGE_ALIGN(size));
+        if (!snapshot->data) {
+            srcu_read_unlock(&dev->srcu, idx);
+            goto nomem;
+        }
+    }
+    snapshot->size = size;
+    snapshot->num_entries = count;
+    size = 0;
+    for (i = 0; i < count; i++) {
+        memcpy(snapshot->data + size, ring[i].buffptr, ring[i].size);
+        snapshot->entries[i].offset = size;
+        snapshot->entries[i].size = ring[i].size;
+        size += ring[i].size;
     }
+    srcu_read_unlock(&dev->srcu, idx);
 
-    retval = fixed_size_llseek(filp, offset, whence, total_size);
+    kvfree(ring);
+    return snapshot;
 
-    mutex_unlock(&dev->lock);
+nomem:
+    kvfree(ring);
+    if (snapshot)
+        kvfree(snapshot->entries);
+    kfree(snapshot);
+    return NULL;
+}
+
+/**
+ * Replace the file's snapshot with a fresh capture.
+ * @return a new reference to the snapshot, or NULL on allocation failure.
+ */
+static struct aesd_snapshot *aesd_file_new_snapshot(struct aesd_file *file)
+{
+    struct aesd_snapshot *snapshot = aesd_snapshot_capture(file->dev);
+
+    if (!snapshot)
+        return NULL;
+    kref_get(&snapshot->ref);
+    mutex_lock(&file->lock);
+    aesd_snapshot_put(file->snapshot);
+    file->snapshot = snapshot;
+    mutex_unlock(&file->lock);
+    return snapshot;
+}
+
+/**
+ * Switch the file in or out of follow mode, carrying the current position over.
+ */
+static long aesd_ioctl_follow(struct file *filp, uint32_t __user *uenable)
+{
+    struct aesd_file *file = filp->private_data;
+    size_t start, end;
+    uint32_t enable;
+
+    if (get_user(enable, uenable))
+        return -EFAULT;
+
+    aesd_stream_window(file->dev, &start, &end);
+    if (enable && !file->follow) {
+        file->follow_pos = start + min_t(size_t, filp->f_pos, end - start);
+        file->follow = true;
+    } else if (!enable && file->follow) {
+        file->follow = false;
+        filp->f_pos = (ssize_t)(start - file->follow_pos) > 0 ? 0 : file->follow_pos - start;
+    }
+    return 0;
+}
+
+static long aesd_ioctl_snapshot(struct file *filp, struct aesd_snapshot_info __user *uinfo)
+{
+    struct aesd_snapshot_info info;
+    struct aesd_snapshot *snapshot;
+    long retval = 0;
+    uint32_t n;
+
+    if (copy_from_user(&info, uinfo, sizeof(info)))
+        return -EFAULT;
+
+    snapshot = aesd_file_new_snapshot(filp->private_data);
+    if (!snapshot)
+        return -ENOMEM;
+
+    info.num_entries = snapshot->num_entries;
+    info.size = snapshot->size;
+    n = min(info.max_entries, info.num_entries);
+    if (info.entries && n &&
+        copy_to_user(u64_to_user_ptr(info.entries), snapshot->entries, n * sizeof(*snapshot->entries)))
+        retval = -EFAULT;
+    else if (copy_to_user(uinfo, &info, sizeof(info)))
+        retval = -EFAULT;
+
+    aesd_snapshot_put(snapshot);
     return retval;
 }
 
-long aesd_adjust_file_offset(struct file *filp, uint32_t write_cmd, uint32_t write_cmd_offset)
+/**
+ * Commit every newline-terminated command of a batch under one dev->lock
+ * acquisition and one seqcount section, so readers see all of them or none.
+ * Blocks are allocated and filled before taking the lock; only prepending a
+ * parked write to the first command has to happen under it.
+ */
+static long aesd_ioctl_write_batch(struct file *filp, struct aesd_write_batch __user *ubatch)
 {
-    struct aesd_dev *dev = filp->private_data;
-    size_t total_offset = 0;
-    int i;
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    struct aesd_write_batch batch;
+    struct aesd_buffer_entry *entries = NULL;
+    struct aesd_entry_block *new_block, *tail_block = NULL;
+    char *data, *line, *newline, *end;
+    unsigned int nr_entries = 0, evicted = 0, i;
+    size_t tail_size;
     long retval = 0;
+    u64 start, locked;
 
-    if (mutex_lock_interruptible(&dev->lock))
-        return -ERESTARTSYS;
+    if (copy_from_user(&batch, ubatch, sizeof(batch)))
+        return -EFAULT;
+    if (batch.len > MAX_RW_COUNT)
+        return -EINVAL;
 
-    // 1. Calculate the index in the circular buffer
-    // The test sends 0-indexed commands relative to current contents
-    uint8_t index = (dev->buffer.out_offs + write_cmd) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    start = ktime_get_ns();
+    data = vmemdup_user(u64_to_user_ptr(batch.buf), batch.len);
+    if (IS_ERR(data))
+        return PTR_ERR(data);
+    aesd_stats_record_since(&dev->stats, AESD_HIST_COPY_FROM_USER, start);
+    end = data + batch.len;
 
-    // 2. Bounds check
-    if (write_cmd >= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED || dev->buffer.entry[index].buffptr == NULL) {
-        retval = -EINVAL;
-        goto unlock;
+    for (line = data; (newline = memchr(line, '\n', end - line)) != NULL; line = newline + 1)
+        nr_entries++;
+    tail_size = end - line;
+
+    if (nr_entries) {
+        entries = kvcalloc(nr_entries, sizeof(*entries), GFP_KERNEL);
+        if (!entries) {
+            retval = -ENOMEM;
+            goto out_free;
+        }
+        for (i = 0, line = data; i < nr_entries; i++, line = newline + 1) {
+            newline = memchr(line, '\n', end - line);
+            new_block = aesd_entry_block_alloc(newline + 1 - line);
+            if (!new_block) {
+                retval = -ENOMEM;
+                goto out_free;
+            }
+            memcpy(new_block->data, line, newline + 1 - line);
+            entries[i].buffptr = new_block->data;
+            entries[i].size = newline + 1 - line;
+        }
+        // The file's partial write goes into the first command, the tail starts a new one
+        if (tail_size) {
+            tail_block = aesd_entry_block_alloc(tail_size);
+            if (!tail_block) {
+                retval = -ENOMEM;
+                goto out_free;
+            }
+            memcpy(tail_block->data, line, tail_size);
+        }
+    }
+
+    if (!batch.len)
+        goto out_report;
+
+    if (mutex_lock_interruptible(&file->write_lock)) {
+        retval = -ERESTARTSYS;
+        goto out_free;
+    }
+
+    if (!nr_entries) {
+        // No newline at all, this only extends the file's partial write
+        new_block = aesd_entry_block_grow(file->partial_entry, file->partial_entry_size,
+                                          file->partial_entry_size + tail_size);
+        if (!new_block) {
+            mutex_unlock(&file->write_lock);
+            retval = -ENOMEM;
+            goto out_free;
+        }
+        file->partial_entry = new_block;
+        memcpy(file->partial_entry->data + file->partial_entry_size, data, tail_size);
+        file->partial_entry_size += tail_size;
+        mutex_unlock(&file->write_lock);
+        goto out_report;
+    }
+
+    // The file's partial write is only dropped once the batch is committed
+    if (file->partial_entry_size) {
+        new_block = aesd_entry_block_alloc(file->partial_entry_size + entries[0].size);
+        if (!new_block) {
+            mutex_unlock(&file->write_lock);
+            retval = -ENOMEM;
+            goto out_free;
+        }
+        memcpy(new_block->data, file->partial_entry->data, file->partial_entry_size);
+        memcpy(new_block->data + file->partial_entry_size, entries[0].buffptr, entries[0].size);
+        aesd_entry_block_free(aesd_entry_block_of(entries[0].buffptr));
+        entries[0].buffptr = new_block->data;
+        entries[0].size += file->partial_entry_size;
     }
-    if (write_cmd_offset >= dev->buffer.entry[index].size) {
+
+    locked = aesd_dev_lock(dev);
+    new_block = aesd_adopt_parked(dev, aesd_entry_block_of(entries[0].buffptr), &entries[0].size);
+    if (!new_block) {
+        aesd_dev_unlock(dev, locked);
+        mutex_unlock(&file->write_lock);
+        retval = -ENOMEM;
+        goto out_free;
+    }
+    entries[0].buffptr = new_block->data;
+
+    write_seqcount_begin(&dev->seq);
+    for (i = 0; i < nr_entries; i++)
+        evicted += aesd_commit_entry(dev, entries[i].buffptr, entries[i].size);
+    write_seqcount_end(&dev->seq);
+    aesd_dev_unlock(dev, locked);
+    aesd_stats_add(&dev->stats, AESD_STAT_COMMITS, nr_entries);
+    aesd_stats_add(&dev->stats, AESD_STAT_EVICTIONS, evicted);
+
+    aesd_entry_block_free(file->partial_entry);
+    file->partial_entry = tail_block;
+    file->partial_entry_size = tail_size;
+    mutex_unlock(&file->write_lock);
+
+    wake_up_interruptible(&dev->wq);
+    // Everything now belongs to the device
+    tail_block = NULL;
+    kvfree(entries);
+    entries = NULL;
+
+out_report:
+    aesd_stats_add(&dev->stats, AESD_STAT_WRITES, 1);
+    aesd_stats_add(&dev->stats, AESD_STAT_WRITE_BYTES, batch.len);
+    batch.accepted = nr_entries;
+    batch.evicted = evicted;
+    if (copy_to_user(ubatch, &batch, sizeof(batch)))
+        retval = -EFAULT;
+
+out_free:
+    if (entries) {
+        for (i = 0; i < nr_entries && entries[i].buffptr; i++)
+            aesd_entry_block_free(aesd_entry_block_of(entries[i].buffptr));
+        kvfree(entries);
+    }
+    aesd_entry_block_free(tail_block);
+    kvfree(data);
+    return retval;
+}
+
+/**
+ * Copy the history out as an image: the header, the entry size table, the
+ * entries and the parked write. The snapshot is captured with dev->lock held
+ * so the parked write belongs with it.
+ */
+static long aesd_ioctl_save(struct file *filp, struct aesd_image __user *uimage)
+{
+    struct aesd_dev *dev = aesd_file_dev(filp);
+    struct aesd_image image;
+    struct aesd_image_header header = {
+        .magic = AESD_IMAGE_MAGIC,
+        .version = AESD_IMAGE_VERSION,
+    };
+    struct aesd_snapshot *snapshot;
+    uint32_t *sizes = NULL;
+    char *parked = NULL;
+    char __user *ubuf;
+    size_t parked_size, table_size;
+    unsigned int i;
+    long retval = 0;
+    u64 locked;
+
+    if (copy_from_user(&image, uimage, sizeof(image)))
+        return -EFAULT;
+
+    locked = aesd_dev_lock(dev);
+    snapshot = aesd_snapshot_capture(dev);
+    parked_size = dev->parked_entry_size;
+    if (snapshot && parked_size) {
+        parked = kvmalloc(parked_size, GFP_KERNEL);
+        if (parked)
+            memcpy(parked, dev->parked_entry->data, parked_size);
+    }
+    aesd_dev_unlock(dev, locked);
+    if (!snapshot || (parked_size && !parked)) {
+        retval = -ENOMEM;
+        goto out;
+    }
+
+    table_size = snapshot->num_entries * sizeof(*sizes);
+    if (table_size) {
+        sizes = kvmalloc(table_size, GFP_KERNEL);
+        if (!sizes) {
+            retval = -ENOMEM;
+            goto out;
+        }
+    }
+    for (i = 0; i < snapshot->num_entries; i++) {
+        if (snapshot->entries[i].size > U32_MAX) {
+            retval = -EFBIG;
+            goto out;
+        }
+        sizes[i] = snapshot->entries[i].size;
+    }
+    if (parked_size > U32_MAX) {
+        retval = -EFBIG;
+        goto out;
+    }
+    header.num_entries = snapshot->num_entries;
+    header.parked_size = parked_size;
+    header.data_size = snapshot->size;
+
+    image.size = sizeof(header) + table_size + snapshot->size + parked_size;
+    image.num_entries = snapshot->num_entries;
+    image.evicted = 0;
+    ubuf = u64_to_user_ptr(image.buf);
+    if (image.buf && image.len >= image.size &&
+        (copy_to_user(ubuf, &header, sizeof(header)) ||
+         copy_to_user(ubuf + sizeof(header), sizes, table_size) ||
+         copy_to_user(ubuf + sizeof(header) + table_size, snapshot->data, snapshot->size) ||
+         copy_to_user(ubuf + sizeof(header) + table_size + snapshot->size, parked, parked_size)))
+        retval = -EFAULT;
+    else if (copy_to_user(uimage, &image, sizeof(image)))
+        retval = -EFAULT;
+
+out:
+    kvfree(sizes);
+    kvfree(parked);
+    aesd_snapshot_put(snapshot);
+    return retval;
+}
+
+/**
+ * Replace the history with an image saved by AESDCHAR_IOCSAVE, possibly by a
+ * previous load of the module. Every entry is allocated and filled before
+ * dev->lock is taken; the old entries are then evicted and the new ones
+ * committed in one seqcount section, so readers see either history whole.
+ * Followers get -EPIPE as after any eviction.
+ */
+static long aesd_ioctl_restore(struct file *filp, struct aesd_image __user *uimage)
+{
+    struct aesd_dev *dev = aesd_file_dev(filp);
+    struct aesd_image image;
+    struct aesd_image_header header;
+    struct aesd_entry_block **blocks = NULL;
+    struct aesd_entry_block *parked = NULL;
+    const char __user *ubuf;
+    uint32_t *sizes = NULL;
+    unsigned int evicted = 0, i;
+    size_t offset, data_size = 0;
+    long retval = 0;
+    u64 locked;
+
+    if (copy_from_user(&image, uimage, sizeof(image)))
+        return -EFAULT;
+    ubuf = u64_to_user_ptr(image.buf);
+    if (image.len < sizeof(header))
+        return -EINVAL;
+    if (copy_from_user(&header, ubuf, sizeof(header)))
+        return -EFAULT;
+    if (header.magic != AESD_IMAGE_MAGIC || header.version != AESD_IMAGE_VERSION ||
+        header.data_size > image.len ||
+        sizeof(header) + (u64)header.num_entries * sizeof(*sizes) + header.data_size + header.parked_size !=
+            image.len)
+        return -EINVAL;
+
+    offset = sizeof(header) + header.num_entries * sizeof(*sizes);
+    if (header.num_entries) {
+        sizes = vmemdup_user(ubuf + sizeof(header), header.num_entries * sizeof(*sizes));
+        if (IS_ERR(sizes))
+            return PTR_ERR(sizes);
+        blocks = kvcalloc(header.num_entries, sizeof(*blocks), GFP_KERNEL);
+        if (!blocks) {
+            retval = -ENOMEM;
+            goto out_free;
+        }
+    }
+    for (i = 0; i < header.num_entries; i++) {
+        data_size += sizes[i];
+        if (!sizes[i] || data_size > header.data_size) {
+            retval = -EINVAL;
+            goto out_free;
+        }
+        blocks[i] = aesd_entry_block_alloc(sizes[i]);
+        if (!blocks[i]) {
+            retval = -ENOMEM;
+            goto out_free;
+        }
+        if (copy_from_user(blocks[i]->data, ubuf + offset, sizes[i])) {
+            retval = -EFAULT;
+            goto out_free;
+        }
+        offset += sizes[i];
+    }
+    if (data_size != header.data_size) {
         retval = -EINVAL;
-        goto unlock;
+        goto out_free;
+    }
+    if (header.parked_size) {
+        parked = aesd_entry_block_alloc(header.parked_size);
+        if (!parked) {
+            retval = -ENOMEM;
+            goto out_free;
+        }
+        if (copy_from_user(parked->data, ubuf + offset, header.parked_size)) {
+            retval = -EFAULT;
+            goto out_free;
+        }
     }
 
-    // 3. Calculate offset to the start of the requested command
-    for (i = 0; i < write_cmd; i++) {
-        total_offset += dev->buffer.entry[(dev->buffer.out_offs + i) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED].size;
+    locked = aesd_dev_lock(dev);
+    write_seqcount_begin(&dev->seq);
+    while (aesd_circular_buffer_count(&dev->buffer)) {
+        if (trace_aesd_evict_enabled())
+            trace_aesd_evict(aesd_dev_minor(dev), aesd_circular_buffer_get_entry(&dev->buffer, 0, NULL)->size,
+                             false);
+        aesd_entry_free_deferred(dev, aesd_circular_buffer_remove_oldest(&dev->buffer));
+        evicted++;
     }
-    
-    // 4. Set f_pos to start of command + internal offset
-    filp->f_pos = total_offset + write_cmd_offset;
+    for (i = 0; i < header.num_entries; i++)
+        evicted += aesd_commit_entry(dev, blocks[i]->data, sizes[i]);
+    write_seqcount_end(&dev->seq);
+    // Readers never see the parked write, it can be swapped and freed directly
+    swap(dev->parked_entry, parked);
+    dev->parked_entry_size = header.parked_size;
+    aesd_dev_unlock(dev, locked);
+    aesd_stats_add(&dev->stats, AESD_STAT_COMMITS, header.num_entries);
+    aesd_stats_add(&dev->stats, AESD_STAT_EVICTIONS, evicted);
+    wake_up_interruptible(&dev->wq);
+    // Everything now belongs to the device, parked holds the previous parked write
+    kvfree(blocks);
+    blocks = NULL;
 
-unlock:
-    mutex_unlock(&dev->lock);
+    image.size = image.len;
+    image.num_entries = header.num_entries;
+    image.evicted = evicted;
+    if (copy_to_user(uimage, &image, sizeof(image)))
+        retval = -EFAULT;
+
+out_free:
+    if (blocks) {
+        for (i = 0; i < header.num_entries && blocks[i]; i++)
+            aesd_entry_block_free(blocks[i]);
+        kvfree(blocks);
+    }
+    aesd_entry_block_free(parked);
+    kvfree(sizes);
+    return retval;
+}
+
+/**
+ * Report where a pattern occurs in the history. Like reads this runs without
+ * dev->lock: the entry descriptors are copied under the seqcount, then
+ * searched in place under SRCU, so the reported indices all refer to the
+ * same state of the ring and nothing but the results is copied to user space.
+ */
+static long aesd_ioctl_search(struct file *filp, struct aesd_search __user *usearch)
+{
+    struct aesd_dev *dev = aesd_file_dev(filp);
+    struct aesd_seekto __user *uresults;
+    struct aesd_buffer_entry *ring, *entry;
+    struct aesd_search search;
+    struct aesd_seekto match;
+    unsigned int count, seq, i;
+    size_t offset;
+    long retval = 0;
+    char *pattern;
+    int idx;
+
+    if (copy_from_user(&search, usearch, sizeof(search)))
+        return -EFAULT;
+    if (!search.pattern_len || search.pattern_len > AESD_SEARCH_MAX_PATTERN ||
+        (search.flags & ~AESD_SEARCH_PREFIX))
+        return -EINVAL;
+    if (!search.results)
+        search.max_results = 0;
+    uresults = u64_to_user_ptr(search.results);
+
+    pattern = memdup_user(u64_to_user_ptr(search.pattern), search.pattern_len);
+    if (IS_ERR(pattern))
+        return PTR_ERR(pattern);
+    ring = kvmalloc_array(dev->buffer.capacity, sizeof(*ring), GFP_KERNEL);
+    if (!ring) {
+        kfree(pattern);
+        return -ENOMEM;
+    }
+
+    idx = srcu_read_lock(&dev->srcu);
+    do {
+        seq = read_seqcount_begin(&dev->seq);
+        count = 0;
+        while ((entry = aesd_circular_buffer_get_entry(&dev->buffer, count, NULL)) != NULL)
+            ring[count++] = *entry;
+    } while (read_seqcount_retry(&dev->seq, seq));
+
+    search.num_results = 0;
+    for (i = 0; i < count && !retval; i++) {
+        offset = 0;
+        // A prefix can only match at offset 0, and only once
+        while ((search.flags & AESD_SEARCH_PREFIX) ?
+               !offset && ring[i].size >= search.pattern_len &&
+                       !memcmp(ring[i].buffptr, pattern, search.pattern_len) :
+               aesd_buffer_entry_find(&ring[i], offset, pattern, search.pattern_len, &offset)) {
+            if (search.num_results < search.max_results) {
+                match.write_cmd = i;
+                match.write_cmd_offset = offset;
+                if (copy_to_user(&uresults[search.num_results], &match, sizeof(match))) {
+                    retval = -EFAULT;
+                    break;
+                }
+            }
+            search.num_results++;
+            offset++;
+        }
+        cond_resched();
+    }
+    srcu_read_unlock(&dev->srcu, idx);
+
+    if (!retval && copy_to_user(usearch, &search, sizeof(search)))
+        retval = -EFAULT;
+    kvfree(ring);
+    kfree(pattern);
     return retval;
 }
 
 long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
     struct aesd_seekto seekto;
+    long retval;
 
     if (_IOC_TYPE(cmd) != AESD_IOC_MAGIC || _IOC_NR(cmd) > AESDCHAR_IOC_MAXNR)
         return -ENOTTY;
 
-    if (cmd == AESDCHAR_IOCSEEKTO) {
+    switch (cmd) {
+    case AESDCHAR_IOCSEEKTO:
         if (copy_from_user(&seekto, (struct aesd_seekto __user *)arg, sizeof(seekto)))
             return -EFAULT;
 
-        return aesd_adjust_file_offset(filp, seekto.write_cmd, seekto.write_cmd_offset);
+        retval = aesd_adjust_file_offset(filp, seekto.write_cmd, seekto.write_cmd_offset);
+        trace_aesd_seekto(aesd_dev_minor(aesd_file_dev(filp)), seekto.write_cmd, seekto.write_cmd_offset,
+                          retval, filp->f_pos);
+        return retval;
+    case AESDCHAR_IOCSNAPSHOT:
+        return aesd_ioctl_snapshot(filp, (struct aesd_snapshot_info __user *)arg);
+    case AESDCHAR_IOCFOLLOW:
+        return aesd_ioctl_follow(filp, (uint32_t __user *)arg);
+    case AESDCHAR_IOCWRITEBATCH:
+        return aesd_ioctl_write_batch(filp, (struct aesd_write_batch __user *)arg);
+    case AESDCHAR_IOCSAVE:
+        return aesd_ioctl_save(filp, (struct aesd_image __user *)arg);
+    case AESDCHAR_IOCRESTORE:
+        return aesd_ioctl_restore(filp, (struct aesd_image __user *)arg);
+    case AESDCHAR_IOCSEARCH:
+        return aesd_ioctl_search(filp, (struct aesd_search __user *)arg);
     }
     return -ENOTTY;
 }
 
+static void aesd_vma_open(struct vm_area_struct *vma)
+{
+    struct aesd_snapshot *snapshot = vma->vm_private_data;
+
+    kref_get(&snapshot->ref);
+}
+
+static void aesd_vma_close(struct vm_area_struct *vma)
+{
+    aesd_snapshot_put(vma->vm_private_data);
+}
+
+static const struct vm_operations_struct aesd_vm_ops = {
+    .open =  aesd_vma_open,
+    .close = aesd_vma_close,
+};
+
+/**
+ * Map the snapshot taken by the last AESDCHAR_IOCSNAPSHOT on this file, or a
+ * fresh one if there is none, read-only into the caller.
+ */
+int aesd_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct aesd_file *file = filp->private_data;
+    struct aesd_snapshot *snapshot;
+    int retval;
+
+    if (vma->vm_flags & VM_WRITE)
+        return -EPERM;
+
+    mutex_lock(&file->lock);
+    snapshot = file->snapshot;
+    if (snapshot)
+        kref_get(&snapshot->ref);
+    mutex_unlock(&file->lock);
+
+    if (!snapshot) {
+        snapshot = aesd_file_new_snapshot(file);
+        if (!snapshot)
+            return -ENOMEM;
+    }
+
+    if (!snapshot->data) {
+        retval = -ENODATA;
+        goto out_put;
+    }
+
+    retval = remap_vmalloc_range(vma, snapshot->data, vma->vm_pgoff);
+    if (retval)
+        goto out_put;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    vm_flags_clear(vma, VM_MAYWRITE);
+#else
+    vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+    // The vma now owns our reference
+    vma->vm_private_data = snapshot;
+    vma->vm_ops = &aesd_vm_ops;
+    return 0;
+
+out_put:
+    aesd_snapshot_put(snapshot);
+    return retval;
+}
+
 struct file_operations aesd_fops = {
     .owner =          THIS_MODULE,
-    .read =           aesd_read,
+    .read_iter =      aesd_read_iter,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+    .splice_read =    copy_splice_read,
+#else
+    .splice_read =    generic_file_splice_read,
+#endif
     .write =          aesd_write,
     .open =           aesd_open,
     .release =        aesd_release,
     .llseek =         aesd_llseek,
+    .poll =           aesd_poll,
     .unlocked_ioctl = aesd_ioctl,
+    .mmap =           aesd_mmap,
     .compat_ioctl =   compat_ptr_ioctl,
 };
 
-static int aesd_setup_cdev(struct aesd_dev *dev)
+static int aesd_setup_cdev(struct aesd_dev *dev, unsigned int index)
 {
-    int err, devno = MKDEV(aesd_major, aesd_minor);
+    int err, devno = MKDEV(aesd_major, aesd_minor + index);
     cdev_init(&dev->cdev, &aesd_fops);
     dev->cdev.owner = THIS_MODULE;
     err = cdev_add (&dev->cdev, devno, 1);
     if (err) {
-        printk(KERN_ERR "Error %d adding aesd cdev", err);
+        printk(KERN_ERR "Error %d adding aesd cdev %u", err, index);
     }
     return err;
 }
 
+/**
+ * Set up the ring, locks and cdev of the device with minor aesd_minor + @param index
+ */
+static int aesd_dev_init(struct aesd_dev *dev, unsigned int index)
+{
+    struct aesd_buffer_entry *entries;
+    int result;
+
+    entries = kvmalloc_array(aesd_max_entries, sizeof(*entries), GFP_KERNEL);
+    if (!entries)
+        return -ENOMEM;
+
+    mutex_init(&dev->lock);
+    seqcount_mutex_init(&dev->seq, &dev->lock);
+    init_waitqueue_head(&dev->wq);
+    aesd_circular_buffer_init_storage(&dev->buffer, entries, aesd_max_entries);
+    result = init_srcu_struct(&dev->srcu);
+    if (result)
+        goto fail_srcu;
+
+    result = aesd_stats_init(&dev->stats);
+    if (result)
+        goto fail_stats;
+
+    result = aesd_setup_cdev(dev, index);
+    if (result)
+        goto fail_cdev;
+    return 0;
+
+fail_cdev:
+    aesd_stats_exit(&dev->stats);
+fail_stats:
+    cleanup_srcu_struct(&dev->srcu);
+fail_srcu:
+    kvfree(entries);
+    return result;
+}
+
+static void aesd_dev_cleanup(struct aesd_dev *dev)
+{
+    uint32_t index;
+    struct aesd_buffer_entry *entry;
+
+    cdev_del(&dev->cdev);
+    // Let pending deferred frees run before tearing down SRCU and the pool
+    srcu_barrier(&dev->srcu);
+    AESD_CIRCULAR_BUFFER_FOREACH(entry, &dev->buffer, index) {
+        if (entry->buffptr)
+            aesd_entry_block_free(aesd_entry_block_of(entry->buffptr));
+    }
+    kvfree(dev->buffer.entry);
+    aesd_entry_block_free(dev->parked_entry);
+    aesd_stats_exit(&dev->stats);
+    cleanup_srcu_struct(&dev->srcu);
+}
+
 int aesd_init_module(void)
 {
     dev_t dev = 0;
+    unsigned int i;
     int result;
-    result = alloc_chrdev_region(&dev, aesd_minor, 1, "aesdchar");
+
+    if (aesd_max_entries == 0 || aesd_nr_devices == 0) {
+        printk(KERN_ERR "aesdchar: aesd_max_entries and aesd_nr_devices must be at least 1\n");
+        return -EINVAL;
+    }
+
+    result = alloc_chrdev_region(&dev, aesd_minor, aesd_nr_devices, "aesdchar");
     aesd_major = MAJOR(dev);
     if (result < 0) return result;
 
-    memset(&aesd_device, 0, sizeof(struct aesd_dev));
-    mutex_init(&aesd_device.lock);
-    aesd_circular_buffer_init(&aesd_device.buffer);
+    result = aesd_entry_pool_init();
+    if (result)
+        goto fail_pool;
+
+    aesd_devices = kcalloc(aesd_nr_devices, sizeof(*aesd_devices), GFP_KERNEL);
+    if (!aesd_devices) {
+        result = -ENOMEM;
+        goto fail_devices;
+    }
+
+    for (i = 0; i < aesd_nr_devices; i++) {
+        result = aesd_dev_init(&aesd_devices[i], i);
+        if (result)
+            goto fail_dev;
+    }
+
+    aesd_debugfs_root = debugfs_create_dir("aesdchar", NULL);
+    aesd_entry_pool_debugfs_init(aesd_debugfs_root);
+    for (i = 0; i < aesd_nr_devices; i++) {
+        char name[24];
+
+        snprintf(name, sizeof(name), "aesdchar%u", i);
+        aesd_stats_debugfs_init(&aesd_devices[i].stats, debugfs_create_dir(name, aesd_debugfs_root));
+    }
+    return 0;
 
-    result = aesd_setup_cdev(&aesd_device);
-    if (result) unregister_chrdev_region(dev, 1);
+fail_dev:
+    while (i--)
+        aesd_dev_cleanup(&aesd_devices[i]);
+    kfree(aesd_devices);
+fail_devices:
+    aesd_entry_pool_exit();
+fail_pool:
+    unregister_chrdev_region(dev, aesd_nr_devices);
     return result;
 }
 
 void aesd_cleanup_module(void)
 {
     dev_t devno = MKDEV(aesd_major, aesd_minor);
-    uint8_t index;
-    struct aesd_buffer_entry *entry;
-    
-    cdev_del(&aesd_device.cdev);
-    AESD_CIRCULAR_BUFFER_FOREACH(entry, &aesd_device.buffer, index) {
-        if (entry->buffptr) kfree(entry->buffptr);
-    }
-    if (aesd_device.partial_entry_ptr) kfree(aesd_device.partial_entry_ptr);
-    unregister_chrdev_region(devno, 1);
+    unsigned int i;
+
+    debugfs_remove_recursive(aesd_debugfs_root);
+    for (i = 0; i < aesd_nr_devices; i++)
+        aesd_dev_cleanup(&aesd_devices[i]);
+    kfree(aesd_devices);
+    aesd_entry_pool_exit();
+    unregister_chrdev_region(devno, aesd_nr_devices);
 }
 
 module_init(aesd_init_module);
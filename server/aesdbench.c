@@ -0,0 +1,384 @@
+/**
+ * @file aesdbench.c
+ * @brief Load generator and latency benchmark for aesdsocket
+ *
+ * Opens a number of concurrent client connections against a running
+ * aesdsocket, sends a configurable mix of packets and reports throughput
+ * and latency percentiles. Each request is timed from connect() until the
+ * server closes the connection after its reply, which is what a client of
+ * the one-shot protocol sees.
+ */
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_HOST "127.0.0.1"
+#define DEFAULT_PORT "9000"
+#define DEFAULT_CONNECTIONS 4
+#define DEFAULT_REQUESTS 1000
+#define DEFAULT_WRITE_SIZE 32
+#define DEFAULT_LARGE_SIZE (256 * 1024)
+// Large packets are sent in pieces of this size so the server sees many recv()s
+#define LARGE_CHUNK 1000
+
+typedef enum packet_kind_t {
+    PACKET_WRITE,
+    PACKET_SEEK,
+    PACKET_LARGE,
+    PACKET_KINDS
+} packet_kind_t;
+
+static const char *packet_kind_names[PACKET_KINDS] = { "write", "seek", "large" };
+
+typedef struct bench_config_t {
+    const char *host;
+    const char *port;
+    long connections;
+    long requests;
+    size_t write_size;
+    size_t large_size;
+    // Relative weights of each packet kind in the mix
+    unsigned int weights[PACKET_KINDS];
+    unsigned int weight_total;
+    int json;
+    struct addrinfo *address;
+} bench_config_t;
+
+typedef struct bench_thread_t {
+    pthread_t thread;
+    const bench_config_t *config;
+    unsigned int id;
+    unsigned int seed;
+    // Latency of every completed request, in nanoseconds
+    uint64_t *latencies;
+    size_t completed;
+    size_t errors;
+    size_t count_by_kind[PACKET_KINDS];
+    uint64_t bytes_sent;
+    uint64_t bytes_received;
+} bench_thread_t;
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-t host] [-p port] [-c connections] [-n requests] [-m mix]\n"
+            "          [-s write_size] [-l large_size] [-j]\n"
+            "  -c  concurrent connections, one thread each (default %d)\n"
+            "  -n  requests per connection (default %d)\n"
+            "  -m  packet mix as write:seek:large weights (default 1:0:0)\n"
+            "  -s  bytes per plain write packet, newline included (default %d)\n"
+            "  -l  bytes per large packet, sent %d bytes per send() (default %d)\n"
+            "  -j  print the report as JSON\n",
+            prog, DEFAULT_CONNECTIONS, DEFAULT_REQUESTS, DEFAULT_WRITE_SIZE, LARGE_CHUNK, DEFAULT_LARGE_SIZE);
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int parse_mix(bench_config_t *config, const char *mix) {
+    unsigned int weights[PACKET_KINDS] = { 0 };
+    int i;
+
+    if (sscanf(mix, "%u:%u:%u", &weights[PACKET_WRITE], &weights[PACKET_SEEK], &weights[PACKET_LARGE]) < 1)
+        return -1;
+    config->weight_total = 0;
+    for (i = 0; i < PACKET_KINDS; i++) {
+        config->weights[i] = weights[i];
+        config->weight_total += weights[i];
+    }
+    return config->weight_total ? 0 : -1;
+}
+
+static packet_kind_t pick_kind(bench_thread_t *bt) {
+    unsigned int r = rand_r(&bt->seed) % bt->config->weight_total;
+    int i;
+
+    for (i = 0; i < PACKET_KINDS - 1; i++) {
+        if (r < bt->config->weights[i]) break;
+        r -= bt->config->weights[i];
+    }
+    return (packet_kind_t)i;
+}
+
+/**
+ * Fill @param buf with the packet for request @param seq and return its length.
+ * @param buf must hold max(write_size, large_size, 64) bytes.
+ */
+static size_t build_packet(bench_thread_t *bt, packet_kind_t kind, size_t seq, char *buf) {
+    size_t len;
+
+    switch (kind) {
+    case PACKET_SEEK:
+        // Always valid once the history holds one entry of at least one byte
+        return snprintf(buf, 64, "AESDCHAR_IOCSEEKTO:0,0\n");
+    case PACKET_LARGE:
+        len = bt->config->large_size;
+        break;
+    case PACKET_WRITE:
+    default:
+        len = bt->config->write_size;
+        break;
+    }
+
+    int prefix = snprintf(buf, len, "bench%u-%zu-", bt->id, seq);
+    if (prefix < 0 || (size_t)prefix >= len) prefix = 0;
+    memset(buf + prefix, 'a' + (seq % 26), len - prefix - 1);
+    buf[len - 1] = '\n';
+    return len;
+}
+
+static int send_all(int fd, const char *buf, size_t len, size_t chunk) {
+    while (len > 0) {
+        ssize_t sent = send(fd, buf, len < chunk ? len : chunk, MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+/**
+ * One request of the one-shot protocol: connect, send, read until EOF.
+ * @return bytes received, or -1 on error.
+ */
+static ssize_t run_request(bench_thread_t *bt, const char *packet, size_t len, size_t chunk) {
+    const struct addrinfo *address = bt->config->address;
+    char reply[16384];
+    ssize_t total = 0;
+    ssize_t bytes;
+    int fd;
+
+    fd = socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC, address->ai_protocol);
+    if (fd == -1) return -1;
+    if (connect(fd, address->ai_addr, address->ai_addrlen) == -1 ||
+        send_all(fd, packet, len, chunk) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    while ((bytes = recv(fd, reply, sizeof(reply), 0)) != 0) {
+        if (bytes == -1) {
+            if (errno == EINTR) continue;
+            close(fd);
+            return -1;
+        }
+        total += bytes;
+    }
+    close(fd);
+    return total;
+}
+
+static void *bench_thread(void *arg) {
+    bench_thread_t *bt = arg;
+    const bench_config_t *config = bt->config;
+    size_t buf_size = config->large_size > config->write_size ? config->large_size : config->write_size;
+    char *packet;
+    long seq;
+
+    if (buf_size < 64) buf_size = 64;
+    packet = malloc(buf_size);
+    if (!packet) return NULL;
+
+    for (seq = 0; seq < config->requests; seq++) {
+        packet_kind_t kind = pick_kind(bt);
+        size_t len = build_packet(bt, kind, seq, packet);
+        uint64_t start = now_ns();
+        ssize_t received = run_request(bt, packet, len, kind == PACKET_LARGE ? LARGE_CHUNK : len);
+
+        if (received < 0) {
+            bt->errors++;
+            continue;
+        }
+        bt->latencies[bt->completed++] = now_ns() - start;
+        bt->count_by_kind[kind]++;
+        bt->bytes_sent += len;
+        bt->bytes_received += received;
+    }
+
+    free(packet);
+    return NULL;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile_us(const uint64_t *sorted, size_t n, double pct) {
+    size_t index;
+
+    if (n == 0) return 0.0;
+    index = (size_t)(pct / 100.0 * (n - 1) + 0.5);
+    return sorted[index] / 1000.0;
+}
+
+static void report(const bench_config_t *config, bench_thread_t *threads, double elapsed_s) {
+    size_t completed = 0, errors = 0, count_by_kind[PACKET_KINDS] = { 0 };
+    uint64_t bytes_sent = 0, bytes_received = 0, sum = 0;
+    uint64_t *all;
+    size_t n = 0;
+    long t;
+    int i;
+
+    for (t = 0; t < config->connections; t++) {
+        completed += threads[t].completed;
+        errors += threads[t].errors;
+        bytes_sent += threads[t].bytes_sent;
+        bytes_received += threads[t].bytes_received;
+        for (i = 0; i < PACKET_KINDS; i++) count_by_kind[i] += threads[t].count_by_kind[i];
+    }
+
+    all = malloc((completed ? completed : 1) * sizeof(*all));
+    if (!all) return;
+    for (t = 0; t < config->connections; t++) {
+        memcpy(all + n, threads[t].latencies, threads[t].completed * sizeof(*all));
+        n += threads[t].completed;
+    }
+    qsort(all, n, sizeof(*all), compare_u64);
+    for (size_t k = 0; k < n; k++) sum += all[k];
+
+    double rps = elapsed_s > 0 ? completed / elapsed_s : 0.0;
+    double mbps = elapsed_s > 0 ? (bytes_sent + bytes_received) / elapsed_s / (1024.0 * 1024.0) : 0.0;
+    double mean = n ? sum / (double)n / 1000.0 : 0.0;
+    double p50 = percentile_us(all, n, 50.0);
+    double p99 = percentile_us(all, n, 99.0);
+    double p999 = percentile_us(all, n, 99.9);
+    double min = n ? all[0] / 1000.0 : 0.0;
+    double max = n ? all[n - 1] / 1000.0 : 0.0;
+
+    if (config->json) {
+        printf("{\"host\":\"%s\",\"port\":\"%s\",\"connections\":%ld,\"requests_per_connection\":%ld,",
+               config->host, config->port, config->connections, config->requests);
+        printf("\"completed\":%zu,\"errors\":%zu,\"elapsed_s\":%.6f,", completed, errors, elapsed_s);
+        printf("\"mix\":{");
+        for (i = 0; i < PACKET_KINDS; i++)
+            printf("%s\"%s\":%zu", i ? "," : "", packet_kind_names[i], count_by_kind[i]);
+        printf("},\"bytes_sent\":%llu,\"bytes_received\":%llu,",
+               (unsigned long long)bytes_sent, (unsigned long long)bytes_received);
+        printf("\"requests_per_s\":%.2f,\"mib_per_s\":%.3f,", rps, mbps);
+        printf("\"latency_us\":{\"min\":%.1f,\"mean\":%.1f,\"p50\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f}}\n",
+               min, mean, p50, p99, p999, max);
+    } else {
+        printf("target        %s:%s\n", config->host, config->port);
+        printf("connections   %ld x %ld requests\n", config->connections, config->requests);
+        printf("completed     %zu (%zu errors) in %.3f s\n", completed, errors, elapsed_s);
+        printf("mix           ");
+        for (i = 0; i < PACKET_KINDS; i++) printf("%s=%zu ", packet_kind_names[i], count_by_kind[i]);
+        printf("\n");
+        printf("throughput    %.2f req/s, %.3f MiB/s (%llu sent, %llu received)\n", rps, mbps,
+               (unsigned long long)bytes_sent, (unsigned long long)bytes_received);
+        printf("latency (us)  min %.1f  mean %.1f  p50 %.1f  p99 %.1f  p999 %.1f  max %.1f\n",
+               min, mean, p50, p99, p999, max);
+    }
+    free(all);
+}
+
+int main(int argc, char *argv[]) {
+    bench_config_t config = {
+        .host = DEFAULT_HOST,
+        .port = DEFAULT_PORT,
+        .connections = DEFAULT_CONNECTIONS,
+        .requests = DEFAULT_REQUESTS,
+        .write_size = DEFAULT_WRITE_SIZE,
+        .large_size = DEFAULT_LARGE_SIZE,
+        .weights = { 1, 0, 0 },
+        .weight_total = 1,
+    };
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    bench_thread_t *threads;
+    uint64_t start;
+    long t, started;
+    int opt, rc;
+
+    while ((opt = getopt(argc, argv, "t:p:c:n:m:s:l:jh")) != -1) {
+        switch (opt) {
+        case 't':
+            config.host = optarg;
+            break;
+        case 'p':
+            config.port = optarg;
+            break;
+        case 'c':
+            config.connections = strtol(optarg, NULL, 10);
+            break;
+        case 'n':
+            config.requests = strtol(optarg, NULL, 10);
+            break;
+        case 'm':
+            if (parse_mix(&config, optarg) == -1) {
+                fprintf(stderr, "Invalid mix '%s'\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 's':
+            config.write_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'l':
+            config.large_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'j':
+            config.json = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (config.connections < 1 || config.requests < 1 || config.write_size < 2 || config.large_size < 2) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    rc = getaddrinfo(config.host, config.port, &hints, &config.address);
+    if (rc != 0) {
+        fprintf(stderr, "Cannot resolve %s:%s: %s\n", config.host, config.port, gai_strerror(rc));
+        return EXIT_FAILURE;
+    }
+
+    threads = calloc(config.connections, sizeof(*threads));
+    if (!threads) return EXIT_FAILURE;
+    for (t = 0; t < config.connections; t++) {
+        threads[t].config = &config;
+        threads[t].id = t;
+        threads[t].seed = (unsigned int)(t * 2654435761u) ^ (unsigned int)getpid();
+        threads[t].latencies = malloc(config.requests * sizeof(uint64_t));
+        if (!threads[t].latencies) return EXIT_FAILURE;
+    }
+
+    start = now_ns();
+    for (started = 0; started < config.connections; started++) {
+        if (pthread_create(&threads[started].thread, NULL, bench_thread, &threads[started]) != 0) {
+            perror("pthread_create");
+            break;
+        }
+    }
+    for (t = 0; t < started; t++) pthread_join(threads[t].thread, NULL);
+    config.connections = started;
+
+    report(&config, threads, (now_ns() - start) / 1e9);
+
+    for (t = 0; t < config.connections; t++) free(threads[t].latencies);
+    free(threads);
+    freeaddrinfo(config.address);
+    return EXIT_SUCCESS;
+}
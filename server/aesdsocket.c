@@ -1,156 +1,1529 @@
+#define _GNU_SOURCE
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <linux/filter.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/timerfd.h>
 #include <syslog.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
-#include <sys/ioctl.h>
 
-// Include the header from driver directory
+#include "backend.h"
+#include "group_commit.h"
+#include "metrics.h"
+#include "uring.h"
 #include "../aesd-char-driver/aesd_ioctl.h"
 
 #define PORT 9000
-#define BACKLOG 10
-#define FILENAME "/dev/aesdchar"
+#define DEFAULT_BACKLOG SOMAXCONN
+#define MAX_EVENTS 64
+#define DEFAULT_QUEUE_DEPTH 64
+#define DEFAULT_LINGER_SECONDS 5
+#define DEFAULT_SEND_TIMEOUT_SECONDS 5
+// How often the reactor checks for the end of draining
+#define DRAIN_POLL_MS 100
+// Receive buffers start small and double up to the cap, beyond which an
+// unterminated packet is staged in the backend chunk by chunk
+#define RECV_BUFFER_MIN 4096
+#define RECV_BUFFER_MAX (64 * 1024)
+// Submission queue size of each io_uring reactor, completions get twice that
+#define URING_ENTRIES 256
 
-typedef struct pthread_arg_t {
-    int new_socket_fd;
-    struct sockaddr_in client_address;
-} pthread_arg_t;
+#define SEEKTO_PREFIX "AESDCHAR_IOCSEEKTO:"
+#define SEEKTO_PREFIX_LEN (sizeof(SEEKTO_PREFIX) - 1)
+// Followed by the pattern, the second form only matches at the start of a command
+#define SEARCH_PREFIX "AESDCHAR_IOCSEARCH:"
+#define SEARCH_PREFIX_LEN (sizeof(SEARCH_PREFIX) - 1)
+#define SEARCH_ANCHORED_PREFIX "AESDCHAR_IOCSEARCHPREFIX:"
+#define SEARCH_ANCHORED_PREFIX_LEN (sizeof(SEARCH_ANCHORED_PREFIX) - 1)
+// Matches listed in the reply to a search
+#define SEARCH_MAX_RESULTS 1024
 
-int socket_fd = -1;
+/**
+ * An epoll loop with its own listening socket. With -r every reactor binds
+ * its own SO_REUSEPORT listener, so the kernel spreads new connections over
+ * them and each connection stays with the reactor that accepted it.
+ */
+typedef struct reactor_t {
+    unsigned int index;
+    int listen_fd;
+    int epoll_fd;
+    pthread_t thread;
+    // Connections accepted here and not freed yet, under connections_lock
+    size_t nr_connections;
+    // Done draining, connection_arm() no longer hands it anything, under connections_lock
+    int stopped;
+    // io_uring engine, NULL when the reactor runs on epoll
+    uring_t *ring;
+    // Operations submitted to the ring whose completion has not been reaped
+    unsigned int inflight;
+    // Filled in by the pending accept
+    struct sockaddr_storage accept_address;
+    socklen_t accept_address_len;
+    // Connections workers handed back, under connections_lock, announced on rearm_fd
+    struct connection_t *rearm;
+    int rearm_fd;
+    uint64_t rearm_count;
+} reactor_t;
 
-void *pthread_routine(void *arg);
-void signal_handler(int sig);
+/**
+ * Per-client state. Owned by its reactor while a packet is being received,
+ * then handed to exactly one worker once it is complete. The socket is
+ * registered with EPOLLONESHOT, or has a single receive queued on the ring,
+ * so the reactor never sees it while a worker holds it; in persistent mode
+ * the worker re-arms it when done.
+ */
+typedef struct connection_t {
+    int socket_fd;
+    struct sockaddr_storage client_address;
+    reactor_t *reactor;
+    char *full_content;
+    size_t total_received;
+    size_t capacity;
+    // full_content is full without a newline and must be staged before receiving more
+    int stage_pending;
+    // Bytes of the current packet already staged in the backend
+    size_t streamed;
+    // The peer shut down its side, process what is buffered and close
+    int eof;
+    // Backend session, kept open across packets in persistent mode
+    backend_session_t session;
+    int session_open;
+    // When the buffered packets were handed to the workers, for request latency
+    uint64_t ready_ns;
+    // Armed in the reactor rather than queued or held by a worker, see connections_lock
+    int in_reactor;
+    // Shut down by the io_uring reactor, freed once its receive completes
+    int closing;
+    struct connection_t *rearm_next;
+    struct connection_t *prev;
+    struct connection_t *next;
+} connection_t;
 
-int main(int argc, char *argv[]) {
-    int new_socket_fd;
-    struct sockaddr_in address;
-    pthread_attr_t pthread_attr;
-    pthread_arg_t *pthread_arg;
-    pthread_t pthread;
-    socklen_t client_address_len;
-    int yes = 1;
+/**
+ * Bounded FIFO of completed connections. When it is full the reactor blocks
+ * in work_queue_push(), which leaves new clients waiting in the listen
+ * backlog instead of growing the number of threads. Once shutdown starts a
+ * full queue refuses connections instead.
+ */
+typedef struct work_queue_t {
+    connection_t **items;
+    size_t depth;
+    size_t head;
+    size_t count;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    // No more pushes, workers return once the queue is empty
+    int closed;
+} work_queue_t;
 
-    openlog("aesdsocket", LOG_PID, LOG_USER);
+typedef enum server_state_t {
+    SERVER_RUNNING,
+    // Not accepting, in-flight requests are finished until the linger deadline
+    SERVER_DRAINING,
+    // The reactors have stopped, workers finish what is queued and close everything
+    SERVER_STOPPING,
+} server_state_t;
+
+reactor_t *reactors;
+// Reactors and listeners, chosen with -r
+unsigned int nr_reactors = 1;
+// Give each listener its own SO_REUSEPORT socket, set by -r
+int reuseport = 0;
+// Pin reactor i to CPU i, chosen with -p
+int pin_reactors = 0;
+int listen_backlog = DEFAULT_BACKLOG;
+// Listen on [::] for both IPv6 and IPv4 clients, chosen with -6
+int dual_stack = 0;
+// Run the reactors on io_uring instead of epoll, chosen with -e
+int use_uring = 0;
+// SIGINT, SIGTERM and SIGUSR1 are blocked in every thread and read from here by the first reactor
+int signal_fd = -1;
+// Readable once shutdown starts, wakes every reactor
+int wake_fd = -1;
+work_queue_t work_queue;
+atomic_int server_state = SERVER_RUNNING;
+// Seconds in-flight requests get to finish after SIGINT or SIGTERM, chosen with -l
+long linger_seconds = DEFAULT_LINGER_SECONDS;
+// How long a worker waits on a client that does not read its reply, chosen with -T
+long send_timeout_seconds = DEFAULT_SEND_TIMEOUT_SECONDS;
+// When draining reactors close what is left, set on the first signal and cut short by a second
+_Atomic uint64_t drain_deadline_ns;
+
+/**
+ * Every open connection, so shutdown can find the ones waiting in a reactor.
+ * Other threads only set in_reactor under this lock, in connection_arm(), so
+ * a reactor walking the list while holding it owns its connections marked
+ * in_reactor.
+ */
+pthread_mutex_t connections_lock = PTHREAD_MUTEX_INITIALIZER;
+connection_t *connections;
+// Keep connections open for further packets instead of closing after one reply
+int persistent_connections = 0;
+// Where the write history is kept, chosen with -b
+const backend_ops_t *backend = &device_backend;
+// Number of independent histories clients are spread over, chosen with -s
+unsigned int nr_shards = 1;
+// Seconds between timestamp lines, 0 for none, chosen with -t
+long timestamp_interval = 0;
+
+void *worker_routine(void *arg);
+void *timestamp_routine(void *arg);
+void handle_connection(connection_t *conn);
+static void handle_signals(void);
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-d] [-k] [-w workers] [-q queue_depth] [-b backend] [-f path] [-s shards] [-m port]\n"
+                    "       [-t seconds] [-g microseconds] [-l seconds] [-r listeners] [-p] [-B backlog] [-6]\n"
+                    "       [-e engine] [-T seconds]\n", prog);
+    fprintf(stderr, "  -k  keep connections open and answer every newline-terminated packet\n");
+    fprintf(stderr, "  -b  device (default, %s), file (append-only, default %s) or ring (in-process)\n",
+            device_backend.default_path, file_backend.default_path);
+    fprintf(stderr, "  -f  path of the device or file backend\n");
+    fprintf(stderr, "  -s  spread clients by address over this many shards, the shard number\n"
+                    "      is appended to the path (load aesdchar with aesd_nr_devices to match)\n");
+    fprintf(stderr, "  -m  serve Prometheus metrics on 127.0.0.1:port, SIGUSR1 logs them to syslog\n");
+    fprintf(stderr, "  -t  append an RFC 2822 timestamp line to every shard at this interval\n");
+    fprintf(stderr, "  -g  group small writes arriving within this window into one backend call\n");
+    fprintf(stderr, "  -l  on SIGINT or SIGTERM stop accepting and give in-flight requests this long\n"
+                    "      to finish, default %d, a second signal stops at once\n", DEFAULT_LINGER_SECONDS);
+    fprintf(stderr, "  -r  accept on this many SO_REUSEPORT listeners, each with its own thread,\n"
+                    "      0 for one per online CPU\n");
+    fprintf(stderr, "  -p  pin listener thread i to CPU i\n");
+    fprintf(stderr, "  -B  listen backlog, default %d\n", DEFAULT_BACKLOG);
+    fprintf(stderr, "  -6  listen on [::] for IPv6 and IPv4 clients alike\n");
+    fprintf(stderr, "  -e  epoll (default) or uring, which batches accepts and receives through\n"
+                    "      io_uring and falls back to epoll where the kernel lacks it\n");
+    fprintf(stderr, "  -T  drop a client that accepts no reply bytes for this long, default %d,\n"
+                    "      0 waits forever\n", DEFAULT_SEND_TIMEOUT_SECONDS);
+}
+
+static int work_queue_init(work_queue_t *queue, size_t depth) {
+    pthread_condattr_t attr;
+
+    queue->items = calloc(depth, sizeof(*queue->items));
+    if (!queue->items) return -1;
+    queue->depth = depth;
+    queue->head = 0;
+    queue->count = 0;
+    queue->closed = 0;
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->not_empty, NULL);
+    // work_queue_push() waits on it in DRAIN_POLL_MS slices
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&queue->not_full, &attr);
+    pthread_condattr_destroy(&attr);
+    return 0;
+}
+
+/**
+ * Queue @param conn for the workers, waiting while the queue is full. Stuck
+ * workers must not keep SIGTERM out, so the first reactor reads signal_fd
+ * between waits, and once shutdown starts a full queue refuses the connection.
+ * @return 0 once queued, -1 if refused.
+ */
+static int work_queue_push(work_queue_t *queue, connection_t *conn) {
+    struct timespec deadline;
+
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == queue->depth) {
+        if (atomic_load(&server_state) != SERVER_RUNNING) {
+            pthread_mutex_unlock(&queue->lock);
+            return -1;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_nsec += DRAIN_POLL_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        if (pthread_cond_timedwait(&queue->not_full, &queue->lock, &deadline) == ETIMEDOUT &&
+            conn->reactor->index == 0) {
+            pthread_mutex_unlock(&queue->lock);
+            handle_signals();
+            pthread_mutex_lock(&queue->lock);
+        }
+    }
+    queue->items[(queue->head + queue->count) % queue->depth] = conn;
+    queue->count++;
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+    return 0;
+}
+
+static connection_t *work_queue_pop(work_queue_t *queue) {
+    connection_t *conn;
+
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0 && !queue->closed) {
+        pthread_cond_wait(&queue->not_empty, &queue->lock);
+    }
+    if (queue->count == 0) {
+        pthread_mutex_unlock(&queue->lock);
+        return NULL;
+    }
+    conn = queue->items[queue->head];
+    queue->head = (queue->head + 1) % queue->depth;
+    queue->count--;
+    pthread_cond_signal(&queue->not_full);
+    pthread_mutex_unlock(&queue->lock);
+    return conn;
+}
+
+static void work_queue_close(work_queue_t *queue) {
+    pthread_mutex_lock(&queue->lock);
+    queue->closed = 1;
+    pthread_cond_broadcast(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+static size_t work_queue_length(void) {
+    size_t count;
+
+    pthread_mutex_lock(&work_queue.lock);
+    count = work_queue.count;
+    pthread_mutex_unlock(&work_queue.lock);
+    return count;
+}
+
+/**
+ * Answer an AESDCHAR_IOCSEARCH command with one "write_cmd,write_cmd_offset"
+ * line per match, at most SEARCH_MAX_RESULTS of them, ready to be sent back
+ * as an AESDCHAR_IOCSEEKTO command. The history itself is not sent.
+ * @return the number of bytes sent, -1 if the client can no longer be written to.
+ */
+static ssize_t send_search_results(connection_t *conn, const char *pattern, size_t len, int prefix) {
+    struct aesd_seekto *results;
+    char *reply = NULL, *p;
+    ssize_t found, sent = 0;
+    size_t reply_len = 0, i;
+
+    // The trailing newline ends the packet, it is not part of the pattern
+    if (len > 0 && pattern[len - 1] == '\n') len--;
+    if (len == 0) return 0;
+
+    results = calloc(SEARCH_MAX_RESULTS, sizeof(*results));
+    if (!results) {
+        syslog(LOG_ERR, "Out of memory searching");
+        return 0;
+    }
+    found = backend->search(&conn->session, pattern, len, prefix, results, SEARCH_MAX_RESULTS);
+    if (found == -1) {
+        syslog(LOG_ERR, "Search failed: %m");
+        metrics_count(METRIC_BACKEND_ERRORS, 1);
+        found = 0;
+    }
+    if (found > SEARCH_MAX_RESULTS) found = SEARCH_MAX_RESULTS;
+
+    // Two 10-digit numbers, a comma and a newline each, and the NUL sprintf() ends with
+    if (found > 0) reply = malloc(found * 22 + 1);
+    for (i = 0, p = reply; reply && i < (size_t)found; i++)
+        p += sprintf(p, "%u,%u\n", results[i].write_cmd, results[i].write_cmd_offset);
+    if (reply) reply_len = p - reply;
+    free(results);
+
+    for (p = reply; reply_len > 0;) {
+        ssize_t bytes = send(conn->socket_fd, p, reply_len, MSG_NOSIGNAL);
+
+        if (bytes == -1) {
+            if (errno == EINTR) continue;
+            sent = -1;
+            break;
+        }
+        p += bytes;
+        sent += bytes;
+        reply_len -= bytes;
+    }
+    free(reply);
+    return sent;
+}
+
+/**
+ * Apply one packet to the backend, either an AESDCHAR_IOCSEEKTO command or a
+ * plain write, then send the history back from the resulting position. An
+ * AESDCHAR_IOCSEARCH command is answered with its matches instead.
+ * @return 0 on success, -1 if the client can no longer be written to.
+ */
+static int process_packet(connection_t *conn, const char *packet, size_t len) {
+    backend_session_t *session = &conn->session;
+    uint64_t start = metrics_now_ns();
+    const char *pattern = NULL;
+    size_t pattern_len = 0;
+    int anchored = 0;
+    ssize_t sent;
+    int ret = 0;
+
+    metrics_count(METRIC_PACKETS, 1);
+    metrics_observe(METRIC_PACKET_SIZE, conn->streamed + len);
+
+    // Check for IOCTL, a packet whose start was staged is always a write
+    if (!conn->streamed && len >= SEARCH_PREFIX_LEN && strncmp(packet, SEARCH_PREFIX, SEARCH_PREFIX_LEN) == 0) {
+        pattern = packet + SEARCH_PREFIX_LEN;
+        pattern_len = len - SEARCH_PREFIX_LEN;
+    } else if (!conn->streamed && len >= SEARCH_ANCHORED_PREFIX_LEN &&
+               strncmp(packet, SEARCH_ANCHORED_PREFIX, SEARCH_ANCHORED_PREFIX_LEN) == 0) {
+        pattern = packet + SEARCH_ANCHORED_PREFIX_LEN;
+        pattern_len = len - SEARCH_ANCHORED_PREFIX_LEN;
+        anchored = 1;
+    } else if (!conn->streamed && len >= SEEKTO_PREFIX_LEN && strncmp(packet, SEEKTO_PREFIX, SEEKTO_PREFIX_LEN) == 0) {
+        unsigned int write_cmd, write_cmd_offset;
+        char args[32];
+        size_t args_len = len - SEEKTO_PREFIX_LEN;
+
+        // The packet is not NUL terminated, and may be followed by the next one
+        if (args_len >= sizeof(args)) args_len = sizeof(args) - 1;
+        memcpy(args, packet + SEEKTO_PREFIX_LEN, args_len);
+        args[args_len] = '\0';
+        if (sscanf(args, "%u,%u", &write_cmd, &write_cmd_offset) == 2) {
+            ret = backend->seekto(session, write_cmd, write_cmd_offset);
+            // After a seek, we do NOT rewind.
+        }
+    } else {
+        // Normal Write, rewinds the session
+        ret = group_commit_write(session, packet, len);
+        conn->streamed = 0;
+    }
+    if (ret == -1) metrics_count(METRIC_BACKEND_ERRORS, 1);
+
+    // Send back the matches of a search, or the history
+    if (pattern) {
+        sent = send_search_results(conn, pattern, pattern_len, anchored);
+    } else {
+        start = metrics_observe_since(METRIC_WRITE_LATENCY, start);
+        sent = backend->send(session, conn->socket_fd);
+    }
+    metrics_observe_since(METRIC_SEND_LATENCY, start);
+    metrics_observe_since(METRIC_REQUEST_LATENCY, conn->ready_ns);
+    if (sent == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            syslog(LOG_DEBUG, "Dropping a client that stopped reading its reply");
+        metrics_count(METRIC_SEND_ERRORS, 1);
+        return -1;
+    }
+    metrics_count(METRIC_BYTES_OUT, sent);
+    return 0;
+}
+
+/**
+ * Pick the shard of a client from its address, so every connection from
+ * one host sees the same history.
+ */
+static unsigned int connection_shard(const connection_t *conn) {
+    const struct sockaddr_storage *address = &conn->client_address;
+    uint32_t key, hash;
+
+    if (address->ss_family == AF_INET6) {
+        const struct in6_addr *ip6 = &((const struct sockaddr_in6 *)address)->sin6_addr;
+        uint32_t words[4];
+
+        memcpy(words, ip6->s6_addr, sizeof(words));
+        // An IPv4 client of a dual-stack listener lands where it would over IPv4
+        if (IN6_IS_ADDR_V4MAPPED(ip6)) key = ntohl(words[3]);
+        else key = ntohl(words[0] ^ words[1] ^ words[2] ^ words[3]);
+    } else {
+        key = ntohl(((const struct sockaddr_in *)address)->sin_addr.s_addr);
+    }
+    hash = key * 2654435761u;
+
+    // Scale the hash to [0, nr_shards) with a multiply instead of a divide
+    return ((uint64_t)hash * nr_shards) >> 32;
+}
+
+static void connection_track(connection_t *conn) {
+    pthread_mutex_lock(&connections_lock);
+    conn->next = connections;
+    if (connections) connections->prev = conn;
+    connections = conn;
+    conn->reactor->nr_connections++;
+    pthread_mutex_unlock(&connections_lock);
+}
+
+/**
+ * Release a connection already removed from the list, or about to be with
+ * connections_lock held.
+ */
+static void connection_release(connection_t *conn) {
+    if (conn->prev) conn->prev->next = conn->next;
+    else connections = conn->next;
+    if (conn->next) conn->next->prev = conn->prev;
+    conn->reactor->nr_connections--;
+
+    atomic_fetch_sub_explicit(&metrics_active_connections, 1, memory_order_relaxed);
+    if (conn->session_open) backend->close(&conn->session);
+    if (conn->socket_fd >= 0) close(conn->socket_fd);
+    free(conn->full_content);
+    free(conn);
+}
+
+static void connection_free(connection_t *conn) {
+    pthread_mutex_lock(&connections_lock);
+    connection_release(conn);
+    pthread_mutex_unlock(&connections_lock);
+}
+
+/**
+ * Hand the socket back to its reactor for the next packet. Fails once the
+ * reactor has stopped, leaving the caller to free the connection.
+ */
+static int connection_arm(connection_t *conn, int op) {
+    reactor_t *reactor = conn->reactor;
+    struct epoll_event event;
+    uint64_t one = 1;
+    int ret = -1;
+
+    event.events = EPOLLIN | EPOLLONESHOT;
+    event.data.ptr = conn;
+    pthread_mutex_lock(&connections_lock);
+    if (reactor->stopped) {
+        // Left for the caller to free
+    } else if (reactor->ring) {
+        // Only the reactor submits to its ring, it queues the receive once woken
+        conn->rearm_next = reactor->rearm;
+        reactor->rearm = conn;
+        conn->in_reactor = 1;
+        if (write(reactor->rearm_fd, &one, sizeof(one)) != sizeof(one))
+            syslog(LOG_ERR, "Cannot wake the io_uring reactor: %m");
+        ret = 0;
+    } else {
+        ret = epoll_ctl(reactor->epoll_fd, op, conn->socket_fd, &event);
+        conn->in_reactor = ret == 0;
+    }
+    pthread_mutex_unlock(&connections_lock);
+    return ret;
+}
+
+/**
+ * Close the connections waiting in @param reactor, all of them or, with
+ * @param idle_only, those between packets. Without @param idle_only the
+ * sockets of its connections queued or held by workers are shut down too.
+ * Only the reactor itself may call this.
+ */
+static void close_reactor_connections(reactor_t *reactor, int idle_only) {
+    connection_t *conn, *next;
+
+    pthread_mutex_lock(&connections_lock);
+    for (conn = connections; conn; conn = next) {
+        next = conn->next;
+        if (conn->reactor != reactor) continue;
+        if (!conn->in_reactor) {
+            // Queued or held by a worker, which frees it once a blocked send returns
+            if (!idle_only) shutdown(conn->socket_fd, SHUT_RDWR);
+            continue;
+        }
+        if (idle_only && (conn->total_received || conn->streamed)) continue;
+        if (reactor->ring) {
+            // Its receive is still queued, shutting the socket down completes it
+            shutdown(conn->socket_fd, SHUT_RDWR);
+            conn->closing = 1;
+        } else {
+            connection_release(conn);
+        }
+    }
+    pthread_mutex_unlock(&connections_lock);
+}
+
+static void connection_accepted(reactor_t *reactor, connection_t *conn) {
+    struct timeval timeout = { .tv_sec = send_timeout_seconds };
+
+    // Replies go out on the blocking socket, a client that stops reading only holds a worker this long
+    if (send_timeout_seconds > 0 &&
+        setsockopt(conn->socket_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) == -1)
+        syslog(LOG_ERR, "Cannot set the send timeout: %m");
+    metrics_count(METRIC_ACCEPTED, 1);
+    atomic_fetch_add_explicit(&metrics_active_connections, 1, memory_order_relaxed);
+    conn->reactor = reactor;
+    connection_track(conn);
+}
 
-    signal(SIGTERM, signal_handler);
-    signal(SIGINT, signal_handler);
+static void accept_connections(reactor_t *reactor) {
+    while (1) {
+        connection_t *conn = calloc(1, sizeof(connection_t));
+        socklen_t client_address_len = sizeof(struct sockaddr_storage);
+
+        if (!conn) {
+            syslog(LOG_ERR, "Out of memory accepting connection");
+            return;
+        }
+
+        // Client sockets stay blocking for the workers, the reactor uses MSG_DONTWAIT
+        conn->socket_fd = accept4(reactor->listen_fd, (struct sockaddr *)&conn->client_address,
+                                  &client_address_len, SOCK_CLOEXEC);
+        if (conn->socket_fd == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                syslog(LOG_ERR, "Accept failed: %m");
+            }
+            free(conn);
+            return;
+        }
+
+        connection_accepted(reactor, conn);
+        if (connection_arm(conn, EPOLL_CTL_ADD) == -1) {
+            syslog(LOG_ERR, "epoll_ctl add failed: %m");
+            connection_free(conn);
+        }
+    }
+}
+
+/**
+ * Make room in conn->full_content for the next receive, doubling it up to
+ * RECV_BUFFER_MAX.
+ * @return 0 when there is room, 1 when the buffer is full and has to be
+ *         staged first, -1 when it cannot grow.
+ */
+static int receive_reserve(connection_t *conn) {
+    size_t capacity = conn->capacity ? conn->capacity * 2 : RECV_BUFFER_MIN;
+    char *new_ptr;
+
+    if (conn->total_received < conn->capacity) return 0;
+    // Only an unterminated packet gets here, anything with a newline was returned
+    if (conn->capacity >= RECV_BUFFER_MAX) {
+        conn->stage_pending = 1;
+        return 1;
+    }
+    if (capacity > RECV_BUFFER_MAX) capacity = RECV_BUFFER_MAX;
+    new_ptr = realloc(conn->full_content, capacity);
+    if (!new_ptr) return -1;
+    conn->full_content = new_ptr;
+    conn->capacity = capacity;
+    return 0;
+}
+
+/**
+ * Account for @param bytes received into the free space of conn->full_content,
+ * 0 meaning the peer shut down its side.
+ * @return as receive_packet()
+ */
+static int receive_complete(connection_t *conn, size_t bytes) {
+    char *received = conn->full_content + conn->total_received;
+
+    if (bytes == 0) {
+        conn->eof = 1;
+        return conn->total_received > 0 || conn->streamed > 0 ? 1 : -1;
+    }
+    conn->total_received += bytes;
+    metrics_count(METRIC_BYTES_IN, bytes);
+    return memchr(received, '\n', bytes) ? 1 : 0;
+}
+
+/**
+ * Drain whatever the socket has buffered into conn->full_content, receiving
+ * straight into its free space.
+ * @return 1 when a newline-terminated packet (or EOF after data) is ready or
+ *         the buffer is full and has to be staged, 0 when more data is needed,
+ *         -1 when the connection should be dropped.
+ *         In persistent mode the buffer may hold several pipelined packets.
+ */
+static int receive_packet(connection_t *conn) {
+    ssize_t bytes;
+    int status;
+
+    while (1) {
+        if ((status = receive_reserve(conn)) != 0) return status;
+
+        bytes = recv(conn->socket_fd, conn->full_content + conn->total_received,
+                     conn->capacity - conn->total_received, MSG_DONTWAIT);
+        if (bytes >= 0) {
+            if ((status = receive_complete(conn, bytes)) != 0) return status;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        } else {
+            return -1;
+        }
+    }
+}
+
+/**
+ * Hand a connection with a complete packet, or a full buffer, to the workers
+ */
+static void reactor_dispatch(connection_t *conn) {
+    conn->in_reactor = 0;
+    conn->ready_ns = metrics_now_ns();
+    // Refused during shutdown while the workers are backed up, the request is dropped
+    if (work_queue_push(&work_queue, conn) == -1) connection_free(conn);
+}
+
+/**
+ * Start draining every reactor: from now on they stop accepting and the
+ * in-flight requests get until the deadline.
+ */
+static void request_shutdown(uint64_t deadline_ns) {
+    uint64_t one = 1;
+
+    atomic_store(&drain_deadline_ns, deadline_ns);
+    atomic_store(&server_state, SERVER_DRAINING);
+    if (write(wake_fd, &one, sizeof(one)) != sizeof(one))
+        syslog(LOG_ERR, "Cannot wake the reactors: %m");
+    // A reactor waiting for room in the queue gives up on it
+    pthread_mutex_lock(&work_queue.lock);
+    pthread_cond_broadcast(&work_queue.not_full);
+    pthread_mutex_unlock(&work_queue.lock);
+}
+
+/**
+ * @return an SQE for @param opcode on the ring of @param reactor, counted
+ *         until its completion is reaped, or NULL if none could be had
+ */
+static struct io_uring_sqe *reactor_uring_sqe(reactor_t *reactor, int opcode, int fd, const void *addr,
+                                              unsigned int len, uint64_t off, void *user_data) {
+    struct io_uring_sqe *sqe = uring_get_sqe(reactor->ring);
+
+    if (!sqe) return NULL;
+    uring_prep(sqe, opcode, fd, addr, len, off, user_data);
+    reactor->inflight++;
+    return sqe;
+}
+
+/**
+ * Stop accepting and let in-flight requests finish. Idle persistent
+ * connections are closed now, their clients reconnect elsewhere.
+ */
+static void start_draining(reactor_t *reactor) {
+    if (reactor->ring) {
+        // The queued accept keeps the listener open until it is cancelled
+        reactor_uring_sqe(reactor, IORING_OP_ASYNC_CANCEL, -1, &reactor->listen_fd, 0, 0, NULL);
+    } else {
+        epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, reactor->listen_fd, NULL);
+        // wake_fd stays readable, keep it from waking this reactor again
+        epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, wake_fd, NULL);
+    }
+    close(reactor->listen_fd);
+    reactor->listen_fd = -1;
+    if (persistent_connections) close_reactor_connections(reactor, 1);
+}
+
+static void handle_signals(void) {
+    struct signalfd_siginfo info;
+
+    while (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+        if (info.ssi_signo == SIGUSR1) {
+            metrics_request_dump();
+        } else if (atomic_load(&server_state) == SERVER_RUNNING) {
+            syslog(LOG_DEBUG, "Caught signal %u, exiting", info.ssi_signo);
+            request_shutdown(metrics_now_ns() + (uint64_t)linger_seconds * 1000000000ULL);
+        } else {
+            // Asked twice, give up on what is still in flight
+            atomic_store(&drain_deadline_ns, 0);
+        }
+    }
+}
+
+/**
+ * Pin the calling reactor to CPU @param index, among the online ones.
+ */
+static void reactor_pin(unsigned int index) {
+    long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t cpus;
+    int err;
+
+    if (nr_cpus < 1) return;
+    CPU_ZERO(&cpus);
+    CPU_SET(index % nr_cpus, &cpus);
+    err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (err) syslog(LOG_ERR, "Cannot pin listener %u: %s", index, strerror(err));
+}
+
+/**
+ * @return 1 once a draining reactor has no connections left or the deadline has passed
+ */
+static int reactor_drained(reactor_t *reactor) {
+    size_t open_connections;
+
+    pthread_mutex_lock(&connections_lock);
+    open_connections = reactor->nr_connections;
+    pthread_mutex_unlock(&connections_lock);
+    if (open_connections == 0) return 1;
+    if (metrics_now_ns() >= atomic_load(&drain_deadline_ns)) {
+        syslog(LOG_INFO, "Closing %zu connections still open after draining", open_connections);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Whatever is still waiting for data will not get it. Queued work still
+ * reaches the backend, but whoever is left past the deadline gets no reply.
+ */
+static void reactor_stop(reactor_t *reactor) {
+    pthread_mutex_lock(&connections_lock);
+    reactor->stopped = 1;
+    pthread_mutex_unlock(&connections_lock);
+    close_reactor_connections(reactor, 0);
+}
+
+static void reactor_epoll_loop(reactor_t *reactor) {
+    struct epoll_event events[MAX_EVENTS];
+    struct epoll_event event;
+    int draining = 0;
+    int i, n;
+
+    /*
+     * A NULL data pointer marks the listening socket, the addresses of
+     * signal_fd and wake_fd those descriptors. Signals are handled by the
+     * first reactor only.
+     */
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->listen_fd, &event) == -1) {
+        syslog(LOG_ERR, "epoll_ctl add listener failed: %m");
+        request_shutdown(0);
+    }
+    event.data.ptr = &wake_fd;
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, wake_fd, &event) == -1) {
+        syslog(LOG_ERR, "epoll_ctl add eventfd failed: %m");
+        request_shutdown(0);
+    }
+    event.data.ptr = &signal_fd;
+    if (reactor->index == 0 && epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, signal_fd, &event) == -1) {
+        syslog(LOG_ERR, "epoll_ctl add signalfd failed: %m");
+        request_shutdown(0);
+    }
+
+    while (1) {
+        if (!draining && atomic_load(&server_state) != SERVER_RUNNING) {
+            start_draining(reactor);
+            draining = 1;
+        }
+        if (draining && reactor_drained(reactor)) break;
+
+        n = epoll_wait(reactor->epoll_fd, events, MAX_EVENTS, draining ? DRAIN_POLL_MS : -1);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            syslog(LOG_ERR, "epoll_wait failed: %m");
+            request_shutdown(0);
+            break;
+        }
+
+        for (i = 0; i < n; i++) {
+            connection_t *conn = events[i].data.ptr;
+            int status;
+
+            if (conn == (void *)&signal_fd) {
+                handle_signals();
+                continue;
+            }
+            // Shutdown itself is picked up at the top of the loop
+            if (conn == (void *)&wake_fd) continue;
+            if (!conn) {
+                accept_connections(reactor);
+                continue;
+            }
+
+            status = receive_packet(conn);
+            if (status > 0) {
+                reactor_dispatch(conn);
+            } else if (status < 0 || connection_arm(conn, EPOLL_CTL_MOD) == -1) {
+                connection_free(conn);
+            }
+        }
+    }
+    reactor_stop(reactor);
+}
+
+/*
+ * io_uring engine: the reactor keeps an accept, one receive per idle
+ * connection and reads of its wakeup descriptors queued on its ring. What it
+ * queues while handling completions goes to the kernel with the same
+ * io_uring_enter() that waits for the next ones. Workers cannot submit to
+ * the ring, connection_arm() hands sockets back through reactor->rearm.
+ */
+
+static int reactor_uring_accept(reactor_t *reactor) {
+    struct io_uring_sqe *sqe;
+
+    reactor->accept_address_len = sizeof(reactor->accept_address);
+    sqe = reactor_uring_sqe(reactor, IORING_OP_ACCEPT, reactor->listen_fd, &reactor->accept_address, 0,
+                            (uintptr_t)&reactor->accept_address_len, &reactor->listen_fd);
+    if (!sqe) return -1;
+    // Client sockets stay blocking for the workers
+    sqe->accept_flags = SOCK_CLOEXEC;
+    return 0;
+}
 
-    address.sin_family = AF_INET;
-    address.sin_port = htons(PORT);
-    address.sin_addr.s_addr = INADDR_ANY;
+static int reactor_uring_poll(reactor_t *reactor, int *fd) {
+    struct io_uring_sqe *sqe = reactor_uring_sqe(reactor, IORING_OP_POLL_ADD, *fd, NULL, 0, 0, fd);
 
-    if ((socket_fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+    if (!sqe) return -1;
+    sqe->poll32_events = POLLIN;
+    return 0;
+}
+
+static int reactor_uring_read_rearm(reactor_t *reactor) {
+    return reactor_uring_sqe(reactor, IORING_OP_READ, reactor->rearm_fd, &reactor->rearm_count,
+                             sizeof(reactor->rearm_count), 0, &reactor->rearm_fd) ? 0 : -1;
+}
+
+/**
+ * Queue a receive into the free space of conn->full_content, or hand the
+ * connection to the workers when its buffer has to be staged first.
+ * @return 0 on success, -1 when the connection should be dropped.
+ */
+static int reactor_uring_recv(reactor_t *reactor, connection_t *conn) {
+    int status = conn->closing ? -1 : receive_reserve(conn);
+
+    if (status > 0) {
+        reactor_dispatch(conn);
+        return 0;
+    }
+    if (status < 0 || !reactor_uring_sqe(reactor, IORING_OP_RECV, conn->socket_fd,
+                                         conn->full_content + conn->total_received,
+                                         conn->capacity - conn->total_received, 0, conn))
+        return -1;
+    conn->in_reactor = 1;
+    return 0;
+}
+
+static void reactor_uring_accepted(reactor_t *reactor, int res) {
+    connection_t *conn;
+
+    if (res < 0) {
+        // Cancelled when draining starts
+        if (res == -ECANCELED) return;
+        if (res != -EAGAIN && res != -EINTR) syslog(LOG_ERR, "Accept failed: %s", strerror(-res));
+    } else if (!(conn = calloc(1, sizeof(connection_t)))) {
+        syslog(LOG_ERR, "Out of memory accepting connection");
+        close(res);
+    } else {
+        conn->socket_fd = res;
+        memcpy(&conn->client_address, &reactor->accept_address, sizeof(conn->client_address));
+        connection_accepted(reactor, conn);
+        if (reactor_uring_recv(reactor, conn) == -1) connection_free(conn);
+    }
+
+    if (reactor->listen_fd >= 0 && reactor_uring_accept(reactor) == -1) {
+        syslog(LOG_ERR, "Cannot queue accept: %m");
+        request_shutdown(0);
+    }
+}
+
+static void reactor_uring_received(reactor_t *reactor, connection_t *conn, int res) {
+    int status;
+
+    if (conn->closing || (res < 0 && res != -EINTR && res != -EAGAIN)) status = -1;
+    else status = res < 0 ? 0 : receive_complete(conn, res);
+
+    if (status > 0) reactor_dispatch(conn);
+    else if (status < 0 || reactor_uring_recv(reactor, conn) == -1) connection_free(conn);
+}
+
+/**
+ * Queue receives for the connections the workers handed back
+ */
+static void reactor_uring_rearm(reactor_t *reactor) {
+    connection_t *conn, *next;
+
+    pthread_mutex_lock(&connections_lock);
+    conn = reactor->rearm;
+    reactor->rearm = NULL;
+    pthread_mutex_unlock(&connections_lock);
+
+    for (; conn; conn = next) {
+        next = conn->rearm_next;
+        // Once stopped nothing new is queued, these have nothing in flight
+        if (reactor->stopped || reactor_uring_recv(reactor, conn) == -1) connection_free(conn);
+    }
+}
+
+static void reactor_uring_complete(reactor_t *reactor, void *tag, int res) {
+    if (!tag) return;
+    if (tag == &signal_fd) {
+        handle_signals();
+        if (!reactor->stopped && reactor_uring_poll(reactor, &signal_fd) == -1)
+            syslog(LOG_ERR, "Cannot queue signalfd poll: %m");
+    } else if (tag == &reactor->rearm_fd) {
+        reactor_uring_rearm(reactor);
+        if (!reactor->stopped && reactor_uring_read_rearm(reactor) == -1)
+            syslog(LOG_ERR, "Cannot queue eventfd read: %m");
+    } else if (tag == &reactor->listen_fd) {
+        reactor_uring_accepted(reactor, res);
+    } else if (tag != &wake_fd) {
+        // Shutdown itself is picked up at the top of the loop
+        reactor_uring_received(reactor, tag, res);
+    }
+}
+
+/**
+ * Hand every completion waiting on the ring to its handler
+ */
+static void reactor_uring_reap(reactor_t *reactor, int *ticking) {
+    struct io_uring_cqe *cqe;
+
+    while ((cqe = uring_peek_cqe(reactor->ring))) {
+        void *tag = (void *)(uintptr_t)cqe->user_data;
+        int res = cqe->res;
+
+        uring_cqe_seen(reactor->ring);
+        reactor->inflight--;
+        if (tag == &drain_deadline_ns) *ticking = 0;
+        else reactor_uring_complete(reactor, tag, res);
+    }
+}
+
+static void reactor_uring_loop(reactor_t *reactor) {
+    struct __kernel_timespec tick = { .tv_nsec = DRAIN_POLL_MS * 1000000LL };
+    int draining = 0;
+    int ticking = 0;
+
+    if (reactor_uring_accept(reactor) == -1 || reactor_uring_poll(reactor, &wake_fd) == -1 ||
+        (reactor->index == 0 && reactor_uring_poll(reactor, &signal_fd) == -1) ||
+        reactor_uring_read_rearm(reactor) == -1) {
+        syslog(LOG_ERR, "Cannot queue io_uring reactor operations: %m");
+        request_shutdown(0);
+    }
+
+    while (1) {
+        if (!draining && atomic_load(&server_state) != SERVER_RUNNING) {
+            start_draining(reactor);
+            draining = 1;
+        }
+        if (draining) {
+            if (reactor_drained(reactor)) break;
+            // Wakes the loop to check the deadline, like the epoll_wait() timeout
+            if (!ticking && reactor_uring_sqe(reactor, IORING_OP_TIMEOUT, -1, &tick, 1, 0, &drain_deadline_ns))
+                ticking = 1;
+        }
+
+        if (uring_submit_and_wait(reactor->ring, 1) == -1) {
+            syslog(LOG_ERR, "io_uring_enter failed: %m");
+            request_shutdown(0);
+            break;
+        }
+        reactor_uring_reap(reactor, &ticking);
+    }
+
+    reactor_stop(reactor);
+    reactor_uring_rearm(reactor);
+    if (reactor->index == 0) reactor_uring_sqe(reactor, IORING_OP_ASYNC_CANCEL, -1, &signal_fd, 0, 0, NULL);
+    reactor_uring_sqe(reactor, IORING_OP_ASYNC_CANCEL, -1, &reactor->rearm_fd, 0, 0, NULL);
+    // Completions still point at connections and at tick
+    while (reactor->inflight) {
+        if (uring_submit_and_wait(reactor->ring, 1) == -1) {
+            syslog(LOG_ERR, "Cannot reap %u io_uring operations: %m", reactor->inflight);
+            break;
+        }
+        reactor_uring_reap(reactor, &ticking);
+    }
+}
+
+static void *reactor_routine(void *arg) {
+    reactor_t *reactor = arg;
+
+    metrics_thread_register();
+    if (pin_reactors) reactor_pin(reactor->index);
+    if (reactor->ring) reactor_uring_loop(reactor);
+    else reactor_epoll_loop(reactor);
+    return NULL;
+}
+
+static int open_listener(void) {
+    struct sockaddr_in address = {
+        .sin_family = AF_INET,
+        .sin_port = htons(PORT),
+        .sin_addr.s_addr = INADDR_ANY,
+    };
+    struct sockaddr_in6 address6 = {
+        .sin6_family = AF_INET6,
+        .sin6_port = htons(PORT),
+        .sin6_addr = IN6ADDR_ANY_INIT,
+    };
+    int yes = 1, no = 0;
+    int fd;
+
+    if ((fd = socket(dual_stack ? AF_INET6 : AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1) {
         syslog(LOG_ERR, "Socket creation failed: %m");
         return -1;
     }
 
-    if (setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) == -1) {
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) == -1) {
         syslog(LOG_ERR, "setsockopt failed: %m");
     }
+    if (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)) == -1) {
+        syslog(LOG_ERR, "SO_REUSEPORT failed: %m");
+        close(fd);
+        return -1;
+    }
+    // Accept IPv4 clients too, as v4-mapped addresses, whatever the sysctl default
+    if (dual_stack && setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &no, sizeof(no)) == -1) {
+        syslog(LOG_ERR, "Cannot clear IPV6_V6ONLY: %m");
+    }
 
-    if (bind(socket_fd, (struct sockaddr *)&address, sizeof address) == -1) {
+    if ((dual_stack ? bind(fd, (struct sockaddr *)&address6, sizeof(address6))
+                    : bind(fd, (struct sockaddr *)&address, sizeof(address))) == -1) {
         syslog(LOG_ERR, "Bind failed: %m");
-        close(socket_fd);
+        close(fd);
         return -1;
     }
 
-    if (listen(socket_fd, BACKLOG) == -1) {
+    if (listen(fd, listen_backlog) == -1) {
         syslog(LOG_ERR, "Listen failed: %m");
-        close(socket_fd);
+        close(fd);
         return -1;
     }
+    return fd;
+}
+
+static void reactor_uring_exit(reactor_t *reactor) {
+    int err = errno;
+
+    if (!reactor->ring) return;
+    if (reactor->ring->sq_ring) uring_exit(reactor->ring);
+    free(reactor->ring);
+    reactor->ring = NULL;
+    if (reactor->rearm_fd >= 0) close(reactor->rearm_fd);
+    reactor->rearm_fd = -1;
+    errno = err;
+}
 
-    if (argc > 1 && strcmp(argv[1], "-d") == 0) {
+static int reactor_uring_init(reactor_t *reactor) {
+    int flags;
+
+    reactor->rearm_fd = -1;
+    reactor->ring = calloc(1, sizeof(*reactor->ring));
+    if (!reactor->ring) return -1;
+    if (uring_init(reactor->ring, URING_ENTRIES) == -1) goto err;
+    reactor->rearm_fd = eventfd(0, EFD_CLOEXEC);
+    if (reactor->rearm_fd == -1) goto err;
+    // A queued accept on a non-blocking listener fails with EAGAIN instead of waiting
+    flags = fcntl(reactor->listen_fd, F_GETFL);
+    if (flags == -1 || fcntl(reactor->listen_fd, F_SETFL, flags & ~O_NONBLOCK) == -1) goto err;
+    return 0;
+
+err:
+    reactor_uring_exit(reactor);
+    return -1;
+}
+
+/**
+ * With one pinned listener per CPU, have the kernel hand each connection to
+ * the listener of the CPU that received it, keeping it on one core from
+ * the SYN to the reply. Listener indexes follow the order they were bound.
+ */
+static void steer_to_local_listener(int fd) {
+    struct sock_filter code[] = {
+        { BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU },
+        { BPF_RET | BPF_A, 0, 0, 0 },
+    };
+    struct sock_fprog prog = {
+        .len = sizeof(code) / sizeof(code[0]),
+        .filter = code,
+    };
+
+    if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == -1)
+        syslog(LOG_ERR, "Cannot steer connections to the local listener: %m");
+}
+
+int main(int argc, char *argv[]) {
+    pthread_t *workers;
+    pthread_t timestamp_thread;
+    sigset_t signals;
+    int timestamp_started = 0;
+    unsigned int started;
+    long num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    long queue_depth = DEFAULT_QUEUE_DEPTH;
+    const char *storage_path = NULL;
+    long commit_window_us = 0;
+    int metrics_port = 0;
+    long listeners = -1;
+    int daemonize = 0;
+    int opt;
+    long i;
+
+    while ((opt = getopt(argc, argv, "dkw:q:b:f:s:m:t:g:l:r:pB:6e:T:")) != -1) {
+        switch (opt) {
+        case 'd':
+            daemonize = 1;
+            break;
+        case 'k':
+            persistent_connections = 1;
+            break;
+        case 'w':
+            num_workers = strtol(optarg, NULL, 10);
+            break;
+        case 'q':
+            queue_depth = strtol(optarg, NULL, 10);
+            break;
+        case 'b':
+            backend = backend_lookup(optarg);
+            if (!backend) {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'f':
+            storage_path = optarg;
+            break;
+        case 's':
+            nr_shards = strtoul(optarg, NULL, 10);
+            break;
+        case 'm':
+            metrics_port = strtol(optarg, NULL, 10);
+            break;
+        case 't':
+            timestamp_interval = strtol(optarg, NULL, 10);
+            break;
+        case 'g':
+            commit_window_us = strtol(optarg, NULL, 10);
+            break;
+        case 'l':
+            linger_seconds = strtol(optarg, NULL, 10);
+            break;
+        case 'r':
+            listeners = strtol(optarg, NULL, 10);
+            break;
+        case 'p':
+            pin_reactors = 1;
+            break;
+        case 'B':
+            listen_backlog = strtol(optarg, NULL, 10);
+            break;
+        case '6':
+            dual_stack = 1;
+            break;
+        case 'e':
+            if (strcmp(optarg, "uring") == 0) {
+                use_uring = 1;
+            } else if (strcmp(optarg, "epoll") != 0) {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'T':
+            send_timeout_seconds = strtol(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+    if (num_workers < 1) num_workers = 1;
+    if (listeners >= 0) {
+        reuseport = 1;
+        nr_reactors = listeners ? listeners : sysconf(_SC_NPROCESSORS_ONLN);
+        if (nr_reactors < 1) nr_reactors = 1;
+    }
+    if (queue_depth < 1 || nr_shards < 1 || timestamp_interval < 0 || commit_window_us < 0 ||
+        linger_seconds < 0 || listen_backlog < 1 || send_timeout_seconds < 0) {
+        usage(argv[0]);
+        return -1;
+    }
+
+    openlog("aesdsocket", LOG_PID, LOG_USER);
+
+    if (!storage_path) storage_path = backend->default_path;
+    if (backend->init(storage_path, nr_shards) == -1) {
+        syslog(LOG_ERR, "Cannot use %s backend %s: %m", backend->name, storage_path ? storage_path : "");
+        return -1;
+    }
+    if (group_commit_init(backend, nr_shards, commit_window_us) == -1) {
+        syslog(LOG_ERR, "Group commit setup failed");
+        return -1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    reactors = calloc(nr_reactors, sizeof(*reactors));
+    if (!reactors) {
+        syslog(LOG_ERR, "Out of memory allocating listeners");
+        return -1;
+    }
+    for (i = 0; i < nr_reactors; i++) {
+        reactors[i].index = i;
+        reactors[i].listen_fd = open_listener();
+        if (reactors[i].listen_fd == -1) return -1;
+    }
+    if (reuseport && pin_reactors && nr_reactors == sysconf(_SC_NPROCESSORS_ONLN))
+        steer_to_local_listener(reactors[0].listen_fd);
+
+    if (daemonize) {
         if (daemon(0, 0) == -1) {
             syslog(LOG_ERR, "Daemonization failed: %m");
         }
     }
 
-    pthread_attr_init(&pthread_attr);
-    pthread_attr_setdetachstate(&pthread_attr, PTHREAD_CREATE_DETACHED);
+    // Blocked before any thread starts so every thread inherits the mask
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (signal_fd == -1 || wake_fd == -1) {
+        syslog(LOG_ERR, "signalfd or eventfd failed: %m");
+        return -1;
+    }
+    for (i = 0; i < nr_reactors; i++) {
+        reactors[i].epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (reactors[i].epoll_fd == -1) {
+            syslog(LOG_ERR, "epoll_create1 failed: %m");
+            return -1;
+        }
+    }
+    for (i = 0; use_uring && i < nr_reactors; i++) {
+        if (reactor_uring_init(&reactors[i]) == -1) {
+            syslog(LOG_ERR, "io_uring unavailable, using epoll: %m");
+            while (i-- > 0) reactor_uring_exit(&reactors[i]);
+            use_uring = 0;
+        }
+    }
 
-    while (1) {
-        pthread_arg = (pthread_arg_t *)malloc(sizeof(pthread_arg_t));
-        if (!pthread_arg) continue;
-
-        client_address_len = sizeof(pthread_arg->client_address);
-        new_socket_fd = accept(socket_fd, (struct sockaddr *)&pthread_arg->client_address, &client_address_len);
-        
-        if (new_socket_fd != -1) {
-            pthread_arg->new_socket_fd = new_socket_fd;
-            pthread_create(&pthread, &pthread_attr, pthread_routine, (void *)pthread_arg);
+    // Threads must be started after daemon() since fork only keeps the caller
+    workers = calloc(num_workers, sizeof(*workers));
+    if (!workers || work_queue_init(&work_queue, queue_depth) == -1) {
+        syslog(LOG_ERR, "Work queue allocation failed");
+        return -1;
+    }
+
+    // One slot per worker and per reactor
+    if (metrics_init(num_workers + nr_reactors) == -1 ||
+        metrics_start(metrics_port, num_workers, work_queue_length) == -1) {
+        syslog(LOG_ERR, "Metrics setup failed: %m");
+    }
+
+    for (i = 0; i < num_workers; i++) {
+        if (pthread_create(&workers[i], NULL, worker_routine, NULL) != 0) {
+            syslog(LOG_ERR, "Worker creation failed: %m");
+            break;
+        }
+    }
+    num_workers = i;
+    if (num_workers == 0) return -1;
+    syslog(LOG_DEBUG, "Started %ld workers, queue depth %ld", num_workers, queue_depth);
+
+    if (timestamp_interval > 0) {
+        if (pthread_create(&timestamp_thread, NULL, timestamp_routine, NULL) != 0) {
+            syslog(LOG_ERR, "Timestamp thread creation failed: %m");
         } else {
-            free(pthread_arg);
+            timestamp_started = 1;
         }
     }
+
+    // The first reactor runs on the main thread
+    for (started = 1; started < nr_reactors; started++) {
+        if (pthread_create(&reactors[started].thread, NULL, reactor_routine, &reactors[started]) != 0) {
+            syslog(LOG_ERR, "Listener thread creation failed: %m");
+            request_shutdown(0);
+            break;
+        }
+    }
+    syslog(LOG_DEBUG, "Accepting on %u listeners, backlog %d", started, listen_backlog);
+    reactor_routine(&reactors[0]);
+    for (i = 1; i < started; i++) pthread_join(reactors[i].thread, NULL);
+
+    // The reactors are done, let the workers empty the queue and exit
+    atomic_store(&server_state, SERVER_STOPPING);
+    work_queue_close(&work_queue);
+    for (i = 0; i < num_workers; i++) pthread_join(workers[i], NULL);
+    free(workers);
+    // Stopped by wake_fd like the reactors
+    if (timestamp_started) pthread_join(timestamp_thread, NULL);
+
+    for (i = 0; i < nr_reactors; i++) {
+        // Reactors whose thread never started still hold their listener
+        if (reactors[i].listen_fd >= 0) close(reactors[i].listen_fd);
+        close(reactors[i].epoll_fd);
+        reactor_uring_exit(&reactors[i]);
+    }
+    free(reactors);
+    close(wake_fd);
+    close(signal_fd);
+    if (backend->cleanup) backend->cleanup();
+    closelog();
     return 0;
 }
 
-void *pthread_routine(void *arg) {
-    pthread_arg_t *pthread_arg = (pthread_arg_t *)arg;
-    int client_fd = pthread_arg->new_socket_fd;
-    
-    // Open the driver IMMEDIATELY when the thread starts
-    int dev_fd = open(FILENAME, O_RDWR);
-    if (dev_fd < 0) {
-        goto cleanup;
+void *worker_routine(void *arg) {
+    connection_t *conn;
+
+    (void)arg;
+    metrics_thread_register();
+    while ((conn = work_queue_pop(&work_queue))) {
+        handle_connection(conn);
     }
+    return NULL;
+}
 
-    char recv_buf[1024];
-    char *full_content = NULL;
-    size_t total_received = 0;
-    ssize_t bytes;
+static int connection_open_session(connection_t *conn) {
+    if (conn->session_open) return 0;
+    if (backend->open(&conn->session, connection_shard(conn)) == -1) {
+        metrics_count(METRIC_BACKEND_ERRORS, 1);
+        return -1;
+    }
+    conn->session_open = 1;
+    return 0;
+}
 
-    while ((bytes = recv(client_fd, recv_buf, sizeof(recv_buf), 0)) > 0) {
-        char *new_ptr = realloc(full_content, total_received + bytes);
-        if (!new_ptr) goto cleanup;
-        full_content = new_ptr;
-        memcpy(full_content + total_received, recv_buf, bytes);
-        total_received += bytes;
-        if (memchr(recv_buf, '\n', bytes)) break;
-    }
-
-    if (total_received > 0) {
-        // Check for IOCTL
-        if (total_received >= 19 && strncmp(full_content, "AESDCHAR_IOCSEEKTO:", 19) == 0) {
-            struct aesd_seekto seekto;
-            if (sscanf(full_content + 19, "%u,%u", &seekto.write_cmd, &seekto.write_cmd_offset) == 2) {
-                ioctl(dev_fd, AESDCHAR_IOCSEEKTO, &seekto);
-                // After ioctl, we do NOT lseek(0).
-            }
-        } else {
-            // Normal Write
-            write(dev_fd, full_content, total_received);
-            lseek(dev_fd, 0, SEEK_SET);
+/**
+ * Hand a full receive buffer to the backend as the start of a packet, so
+ * memory per connection stays at RECV_BUFFER_MAX however large it grows.
+ * @return 0 to keep receiving, -1 to close the connection.
+ */
+static int stage_packet(connection_t *conn) {
+    uint64_t start = metrics_now_ns();
+
+    if (connection_open_session(conn) == -1) return -1;
+    if (backend->stage(&conn->session, conn->full_content, conn->total_received) == -1) {
+        metrics_count(METRIC_BACKEND_ERRORS, 1);
+        return -1;
+    }
+    metrics_observe_since(METRIC_WRITE_LATENCY, start);
+    conn->streamed += conn->total_received;
+    conn->total_received = 0;
+    conn->stage_pending = 0;
+    return connection_arm(conn, EPOLL_CTL_MOD);
+}
+
+/**
+ * Append an RFC 2822 "timestamp:" line to every shard each time the timer
+ * expires. A periodic timerfd keeps the interval steady however long the
+ * writes take. The thread ends between writes once shutdown makes wake_fd
+ * readable, closing its sessions like every other one.
+ */
+void *timestamp_routine(void *arg) {
+    struct itimerspec period = {
+        .it_interval.tv_sec = timestamp_interval,
+        .it_value.tv_sec = timestamp_interval,
+    };
+    struct pollfd fds[2];
+    backend_session_t *sessions;
+    char line[128];
+    uint64_t expirations;
+    unsigned int i;
+    int timer_fd;
+
+    (void)arg;
+    sessions = calloc(nr_shards, sizeof(*sessions));
+    if (!sessions) {
+        syslog(LOG_ERR, "Out of memory starting the timestamp thread");
+        return NULL;
+    }
+    for (i = 0; i < nr_shards; i++) {
+        if (backend->open(&sessions[i], i) == -1) {
+            syslog(LOG_ERR, "Cannot open shard %u for timestamps: %m", i);
+            goto out_close;
+        }
+    }
+
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (timer_fd == -1 || timerfd_settime(timer_fd, 0, &period, NULL) == -1) {
+        syslog(LOG_ERR, "Timestamp timer setup failed: %m");
+        if (timer_fd >= 0) close(timer_fd);
+        goto out_close;
+    }
+    fds[0].fd = timer_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = wake_fd;
+    fds[1].events = POLLIN;
+
+    while (1) {
+        struct tm tm;
+        time_t now;
+        size_t len;
+
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR) continue;
+            syslog(LOG_ERR, "Timestamp timer poll failed: %m");
+            break;
+        }
+        // Nobody reads wake_fd, it stays readable from the start of shutdown on
+        if (fds[1].revents) break;
+        if (read(timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+            if (errno == EINTR) continue;
+            syslog(LOG_ERR, "Timestamp timer read failed: %m");
+            break;
         }
 
-        // Send back
-        char read_buf[1024];
-        while ((bytes = read(dev_fd, read_buf, sizeof(read_buf))) > 0) {
-            send(client_fd, read_buf, bytes, 0);
+        now = time(NULL);
+        localtime_r(&now, &tm);
+        len = strftime(line, sizeof(line), "timestamp:%a, %d %b %Y %T %z\n", &tm);
+        for (i = 0; i < nr_shards; i++) {
+            if (backend->write(&sessions[i], line, len) == -1)
+                syslog(LOG_ERR, "Timestamp write to shard %u failed: %m", i);
         }
     }
+    close(timer_fd);
 
-cleanup:
-    if (dev_fd >= 0) close(dev_fd);
-    if (full_content) free(full_content);
-    close(client_fd);
-    free(arg);
+out_close:
+    while (i-- > 0) backend->close(&sessions[i]);
+    free(sessions);
     return NULL;
 }
 
-void signal_handler(int sig) {
-    syslog(LOG_DEBUG, "Caught signal %d, exiting", sig);
-    if (socket_fd >= 0) close(socket_fd);
-    closelog();
-    exit(0);
+/**
+ * Persistent mode: answer every complete packet buffered on the connection,
+ * in order and over one device fd, then give the socket back to the reactor.
+ * @return 0 to keep the connection, -1 to close it.
+ */
+static int handle_pipelined(connection_t *conn) {
+    size_t consumed = 0;
+    char *newline;
+
+    if (connection_open_session(conn) == -1) return -1;
+
+    while ((newline = memchr(conn->full_content + consumed, '\n', conn->total_received - consumed))) {
+        size_t len = newline - (conn->full_content + consumed) + 1;
+
+        if (process_packet(conn, conn->full_content + consumed, len) == -1)
+            return -1;
+        consumed += len;
+    }
+
+    if (conn->eof) {
+        // Like the one-shot mode, an unterminated tail at EOF is still a packet
+        if (consumed < conn->total_received || conn->streamed)
+            process_packet(conn, conn->full_content + consumed, conn->total_received - consumed);
+        return -1;
+    }
+
+    memmove(conn->full_content, conn->full_content + consumed, conn->total_received - consumed);
+    conn->total_received -= consumed;
+    // Once shutdown starts a connection between packets is closed instead of kept
+    if (atomic_load(&server_state) != SERVER_RUNNING && conn->total_received == 0 && !conn->streamed)
+        return -1;
+    // Give back what a burst of pipelined or large packets grew the buffer to
+    if (conn->capacity > RECV_BUFFER_MIN && conn->total_received <= RECV_BUFFER_MIN) {
+        char *new_ptr = realloc(conn->full_content, RECV_BUFFER_MIN);
+
+        if (new_ptr) {
+            conn->full_content = new_ptr;
+            conn->capacity = RECV_BUFFER_MIN;
+        }
+    }
+    return connection_arm(conn, EPOLL_CTL_MOD);
 }
+
+void handle_connection(connection_t *conn) {
+    if (conn->stage_pending) {
+        if (stage_packet(conn) == -1)
+            connection_free(conn);
+        return;
+    }
+
+    if (persistent_connections) {
+        if (handle_pipelined(conn) == -1)
+            connection_free(conn);
+        return;
+    }
+
+    if (connection_open_session(conn) == 0)
+        process_packet(conn, conn->full_content, conn->total_received);
+    connection_free(conn);
+}
+
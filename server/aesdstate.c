@@ -0,0 +1,151 @@
+/**
+ * @file aesdstate.c
+ * @brief Save and restore the history of an aesdchar device
+ *
+ * Wraps AESDCHAR_IOCSAVE and AESDCHAR_IOCRESTORE so init scripts can carry
+ * the write history of each device across a module reload:
+ *
+ *   aesdstate save /dev/aesdchar0 /var/lib/aesdchar/aesdchar0.img
+ *   aesdstate restore /dev/aesdchar0 /var/lib/aesdchar/aesdchar0.img
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../aesd-char-driver/aesd_ioctl.h"
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s save|restore device image\n"
+            "  save     write the history of device to image, replacing it atomically\n"
+            "  restore  replace the history of device with image\n",
+            prog);
+}
+
+static int write_all(int fd, const char *buf, size_t len) {
+    while (len) {
+        ssize_t written = write(fd, buf, len);
+
+        if (written == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += written;
+        len -= written;
+    }
+    return 0;
+}
+
+static int save(int device_fd, const char *path) {
+    struct aesd_image image = { 0 };
+    char *buf = NULL;
+    char *tmp_path;
+    int fd;
+
+    // The history may grow between asking for the size and copying it
+    do {
+        char *new_buf = realloc(buf, image.size ? image.size : 1);
+
+        if (!new_buf) {
+            perror("realloc");
+            free(buf);
+            return -1;
+        }
+        buf = new_buf;
+        image.buf = (uintptr_t)buf;
+        image.len = image.size;
+        if (ioctl(device_fd, AESDCHAR_IOCSAVE, &image) == -1) {
+            perror("AESDCHAR_IOCSAVE");
+            free(buf);
+            return -1;
+        }
+    } while (image.size > image.len);
+
+    if (asprintf(&tmp_path, "%s.tmp", path) == -1) {
+        free(buf);
+        return -1;
+    }
+    fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1 || write_all(fd, buf, image.size) == -1 || fsync(fd) == -1 || close(fd) == -1 ||
+        rename(tmp_path, path) == -1) {
+        perror(path);
+        unlink(tmp_path);
+        free(tmp_path);
+        free(buf);
+        return -1;
+    }
+    printf("Saved %u write commands, %llu bytes\n", image.num_entries, (unsigned long long)image.size);
+    free(tmp_path);
+    free(buf);
+    return 0;
+}
+
+static int restore(int device_fd, const char *path) {
+    struct aesd_image image = { 0 };
+    struct stat st;
+    char *buf;
+    size_t done = 0;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        perror(path);
+        return -1;
+    }
+    buf = malloc(st.st_size ? st.st_size : 1);
+    if (!buf) {
+        perror("malloc");
+        close(fd);
+        return -1;
+    }
+    while (done < (size_t)st.st_size) {
+        ssize_t bytes = read(fd, buf + done, st.st_size - done);
+
+        if (bytes <= 0) {
+            if (bytes == -1 && errno == EINTR) continue;
+            fprintf(stderr, "%s: short read\n", path);
+            close(fd);
+            free(buf);
+            return -1;
+        }
+        done += bytes;
+    }
+    close(fd);
+
+    image.buf = (uintptr_t)buf;
+    image.len = done;
+    if (ioctl(device_fd, AESDCHAR_IOCRESTORE, &image) == -1) {
+        perror("AESDCHAR_IOCRESTORE");
+        free(buf);
+        return -1;
+    }
+    printf("Restored %u write commands, %u dropped\n", image.num_entries, image.evicted);
+    free(buf);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int device_fd, rc;
+
+    if (argc != 4 || (strcmp(argv[1], "save") != 0 && strcmp(argv[1], "restore") != 0)) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    device_fd = open(argv[2], O_RDWR | O_CLOEXEC);
+    if (device_fd == -1) {
+        perror(argv[2]);
+        return EXIT_FAILURE;
+    }
+    rc = strcmp(argv[1], "save") == 0 ? save(device_fd, argv[3]) : restore(device_fd, argv[3]);
+    close(device_fd);
+    return rc == -1 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
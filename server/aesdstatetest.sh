@@ -0,0 +1,68 @@
+#!/bin/bash
+# Tester for AESDCHAR_IOCSAVE and AESDCHAR_IOCRESTORE through aesdstate
+#
+# Restores an image over a device that already holds a longer history, checks
+# the device then reads back exactly the image, and unloads the module. Every
+# entry the restore evicted has to be freed once and only once, which the
+# unload and the kernel log after it show. Run on the target as root with
+# aesdsocket stopped.
+
+device=/dev/aesdchar0
+rc=0
+
+tempfile() {
+	mktemp
+}
+
+fail()
+{
+	echo "$1"
+	rc=1
+}
+
+# Anything the allocator or the pool noticed since the test started
+check_kernel_log()
+{
+	if dmesg | sed -n '/aesdstatetest: start/,$p' | grep -E 'BUG|Oops|WARNING|double free|corrupt'; then
+		fail "Kernel reported errors $1"
+	fi
+}
+
+/usr/bin/aesdchar_unload 2>/dev/null
+echo "aesdstatetest: start" > /dev/kmsg
+
+image=`tempfile`
+expected=`tempfile`
+result=`tempfile`
+
+echo "Restoring an image over a longer history"
+/usr/bin/aesdchar_load || exit 1
+for i in 1 2 3; do
+	echo "saved${i}" > ${device}
+	echo "saved${i}" >> ${expected}
+done
+aesdstate save ${device} ${image} || fail "aesdstate save failed"
+for i in 1 2 3 4 5 6 7 8 9 10; do
+	echo "later${i}" > ${device}
+done
+aesdstate restore ${device} ${image} || fail "aesdstate restore failed"
+cat ${device} > ${result}
+if ! diff -u ${expected} ${result}; then
+	fail "Restored history does not match the saved image"
+fi
+/usr/bin/aesdchar_unload || fail "Unloading after the restore failed"
+check_kernel_log "after unloading a restored device"
+
+echo "Unloading after evictions of the byte budget"
+/usr/bin/aesdchar_load aesd_max_bytes=32 || exit 1
+for i in 1 2 3 4 5 6 7 8 9 10; do
+	echo "budget${i}" > ${device}
+done
+/usr/bin/aesdchar_unload || fail "Unloading after budget evictions failed"
+check_kernel_log "after unloading a device that evicted for its byte budget"
+
+rm -f ${image} ${expected} ${result}
+if [ ${rc} -eq 0 ]; then
+	echo "Test passed"
+fi
+exit ${rc}
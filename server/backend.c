@@ -0,0 +1,750 @@
+/**
+ * @file backend.c
+ * @brief Storage backends for aesdsocket
+ *
+ * device: the aesdchar driver, the default.
+ * file:   an append-only regular file, for hosts without the module.
+ * ring:   an in-process copy of the driver's circular buffer, which keeps
+ *         the driver's history limit without any per-request syscall.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "backend.h"
+#include "../aesd-char-driver/aesd_ioctl.h"
+#include "../aesd-char-driver/aesd-circular-buffer.h"
+
+#define SENDFILE_CHUNK (1 << 20)
+#define STAGED_COPY_CHUNK (16 * 1024)
+
+// Path of each shard of the device and file backends
+static char **shard_paths;
+static unsigned int nr_shard_paths;
+// Cleared the first time the backend refuses sendfile(), to skip the probe afterwards
+static atomic_int sendfile_supported = 1;
+
+/*
+ * Helpers shared by the descriptor based backends
+ */
+
+/**
+ * Use @param path itself for a single shard, otherwise @param path followed
+ * by the shard number.
+ */
+static int shard_paths_init(const char *path, unsigned int nr_shards) {
+    unsigned int i;
+
+    shard_paths = calloc(nr_shards, sizeof(*shard_paths));
+    if (!shard_paths) return -1;
+    for (i = 0; i < nr_shards; i++) {
+        if (nr_shards == 1) {
+            shard_paths[i] = strdup(path);
+        } else if (asprintf(&shard_paths[i], "%s%u", path, i) == -1) {
+            shard_paths[i] = NULL;
+        }
+        if (!shard_paths[i]) {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    nr_shard_paths = nr_shards;
+    return 0;
+}
+
+static void fd_close(backend_session_t *session) {
+    close(session->fd);
+    session->fd = -1;
+}
+
+static int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(fd, buf, len);
+        if (written == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += written;
+        len -= written;
+    }
+    return 0;
+}
+
+/**
+ * Like write_all() for a client socket, which may take a reply in pieces
+ */
+static int send_all(int client_fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t sent = send(client_fd, buf, len, MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+static int fd_rewind(backend_session_t *session) {
+    return lseek(session->fd, 0, SEEK_SET) == -1 ? -1 : 0;
+}
+
+static int fd_write(backend_session_t *session, const char *buf, size_t len) {
+    if (write_all(session->fd, buf, len) == -1) return -1;
+    return fd_rewind(session);
+}
+
+/**
+ * Stream the contents from the current position to the client.
+ * sendfile() keeps the data in the kernel (the driver supports splice), the
+ * read()/send() loop is kept for kernels or backends that do not.
+ */
+static ssize_t fd_send(backend_session_t *session, int client_fd) {
+    char read_buf[1024];
+    ssize_t bytes, total = 0;
+
+    if (atomic_load_explicit(&sendfile_supported, memory_order_relaxed)) {
+        do {
+            bytes = sendfile(client_fd, session->fd, NULL, SENDFILE_CHUNK);
+            if (bytes > 0) total += bytes;
+        } while (bytes > 0 || (bytes == -1 && errno == EINTR));
+        if (bytes == 0) return total;
+        if (errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP) return -1;
+        atomic_store_explicit(&sendfile_supported, 0, memory_order_relaxed);
+    }
+
+    while ((bytes = read(session->fd, read_buf, sizeof(read_buf))) != 0) {
+        if (bytes == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (send_all(client_fd, read_buf, bytes) == -1) return -1;
+        total += bytes;
+    }
+    return total;
+}
+
+/**
+ * Count the matches of @param pattern in @param entry, command @param
+ * write_cmd, storing them in @param results while it has room.
+ * @return @param found plus the matches in the entry.
+ */
+static size_t entry_search(const struct aesd_buffer_entry *entry, uint32_t write_cmd, const char *pattern,
+                           size_t len, int prefix, struct aesd_seekto *results, size_t max_results, size_t found) {
+    size_t offset = 0;
+
+    // A prefix can only match at offset 0, and only once
+    while (prefix ? !offset && entry->size >= len && memcmp(entry->buffptr, pattern, len) == 0
+                  : aesd_buffer_entry_find(entry, offset, pattern, len, &offset)) {
+        if (found < max_results) {
+            results[found].write_cmd = write_cmd;
+            results[found].write_cmd_offset = offset;
+        }
+        found++;
+        offset++;
+    }
+    return found;
+}
+
+/*
+ * device backend
+ */
+
+static int device_init(const char *path, unsigned int nr_shards) {
+    unsigned int i;
+
+    if (shard_paths_init(path, nr_shards) == -1) return -1;
+    for (i = 0; i < nr_shards; i++) {
+        if (access(shard_paths[i], R_OK | W_OK) == -1) return -1;
+    }
+    return 0;
+}
+
+static int device_open(backend_session_t *session, unsigned int shard) {
+    session->shard = shard;
+    session->fd = open(shard_paths[shard], O_RDWR | O_CLOEXEC);
+    session->staged_size = 0;
+    return session->fd < 0 ? -1 : 0;
+}
+
+/**
+ * The driver already keeps the partial writes of each open file apart until
+ * their newline, so staging is a plain write without the rewind. The bytes
+ * are still counted: the rest of the packet has to follow on this fd.
+ */
+static int device_stage(backend_session_t *session, const char *buf, size_t len) {
+    if (write_all(session->fd, buf, len) == -1) return -1;
+    session->staged_size += len;
+    return 0;
+}
+
+static int device_write(backend_session_t *session, const char *buf, size_t len) {
+    session->staged_size = 0;
+    return fd_write(session, buf, len);
+}
+
+static int device_rewind(backend_session_t *session) {
+    session->staged_size = 0;
+    return fd_rewind(session);
+}
+
+/**
+ * AESDCHAR_IOCWRITEBATCH commits every command with one lock acquisition,
+ * drivers without it get one write() per command.
+ */
+static int device_write_batch(backend_session_t *session, const char *buf, size_t len) {
+    struct aesd_write_batch batch = {
+        .buf = (uintptr_t)buf,
+        .len = len,
+    };
+    const char *end = buf + len;
+    const char *newline;
+
+    session->staged_size = 0;
+    if (ioctl(session->fd, AESDCHAR_IOCWRITEBATCH, &batch) == 0) return fd_rewind(session);
+    if (errno != ENOTTY) return -1;
+
+    while ((newline = memchr(buf, '\n', end - buf))) {
+        if (write_all(session->fd, buf, newline + 1 - buf) == -1) return -1;
+        buf = newline + 1;
+    }
+    return fd_write(session, buf, end - buf);
+}
+
+static int device_seekto(backend_session_t *session, uint32_t write_cmd, uint32_t write_cmd_offset) {
+    struct aesd_seekto seekto = {
+        .write_cmd = write_cmd,
+        .write_cmd_offset = write_cmd_offset,
+    };
+
+    return ioctl(session->fd, AESDCHAR_IOCSEEKTO, &seekto);
+}
+
+static ssize_t device_search(backend_session_t *session, const char *pattern, size_t len, int prefix,
+                             struct aesd_seekto *results, size_t max_results) {
+    struct aesd_search search = {
+        .pattern = (uintptr_t)pattern,
+        .pattern_len = len,
+        .flags = prefix ? AESD_SEARCH_PREFIX : 0,
+        .results = (uintptr_t)results,
+        .max_results = max_results,
+    };
+
+    if (ioctl(session->fd, AESDCHAR_IOCSEARCH, &search) == -1) return -1;
+    return search.num_results;
+}
+
+const backend_ops_t device_backend = {
+    .name = "device",
+    .default_path = "/dev/aesdchar",
+    .init = device_init,
+    .open = device_open,
+    .close = fd_close,
+    .write = device_write,
+    .stage = device_stage,
+    .write_batch = device_write_batch,
+    .rewind = device_rewind,
+    .seekto = device_seekto,
+    .search = device_search,
+    .send = fd_send,
+};
+
+/*
+ * file backend
+ */
+
+/**
+ * Writes of whole packets rely on O_APPEND and only share the lock, copying
+ * staged bytes takes several write() calls and holds it exclusively.
+ */
+static pthread_rwlock_t *file_locks;
+// Staged bytes go to unlinked files next to the shards
+static char *staging_dir;
+
+static int file_init(const char *path, unsigned int nr_shards) {
+    unsigned int i;
+    char *path_copy;
+    int fd;
+
+    if (shard_paths_init(path, nr_shards) == -1) return -1;
+    file_locks = calloc(nr_shards, sizeof(*file_locks));
+    path_copy = strdup(path);
+    if (!file_locks || !path_copy) {
+        errno = ENOMEM;
+        return -1;
+    }
+    staging_dir = strdup(dirname(path_copy));
+    free(path_copy);
+    if (!staging_dir) {
+        errno = ENOMEM;
+        return -1;
+    }
+    for (i = 0; i < nr_shards; i++) {
+        fd = open(shard_paths[i], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) return -1;
+        close(fd);
+        pthread_rwlock_init(&file_locks[i], NULL);
+    }
+    return 0;
+}
+
+static void file_cleanup(void) {
+    unsigned int i;
+
+    for (i = 0; i < nr_shard_paths; i++) unlink(shard_paths[i]);
+}
+
+static int file_open(backend_session_t *session, unsigned int shard) {
+    // O_APPEND makes every write() land whole at the end, whichever worker issues it
+    session->shard = shard;
+    session->fd = open(shard_paths[shard], O_RDWR | O_APPEND | O_CLOEXEC);
+    session->staged_fd = -1;
+    session->staged_size = 0;
+    return session->fd < 0 ? -1 : 0;
+}
+
+static void file_close(backend_session_t *session) {
+    if (session->staged_fd >= 0) close(session->staged_fd);
+    session->staged_fd = -1;
+    fd_close(session);
+}
+
+static int staging_file_open(void) {
+    char *template;
+    int fd;
+
+    fd = open(staging_dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd >= 0 || (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL)) return fd;
+
+    // Filesystems without O_TMPFILE
+    if (asprintf(&template, "%s/.aesdsocket-XXXXXX", staging_dir) == -1) return -1;
+    fd = mkostemp(template, O_CLOEXEC);
+    if (fd >= 0) unlink(template);
+    free(template);
+    return fd;
+}
+
+/**
+ * Staged bytes go to a file rather than memory, so a packet of any size
+ * costs the connection nothing more than its receive buffer.
+ */
+static int file_stage(backend_session_t *session, const char *buf, size_t len) {
+    if (session->staged_fd < 0) {
+        session->staged_fd = staging_file_open();
+        if (session->staged_fd < 0) return -1;
+    }
+    if (write_all(session->staged_fd, buf, len) == -1) return -1;
+    session->staged_size += len;
+    return 0;
+}
+
+static int file_write(backend_session_t *session, const char *buf, size_t len) {
+    pthread_rwlock_t *lock = &file_locks[session->shard];
+    char copy_buf[STAGED_COPY_CHUNK];
+    off_t pos = 0;
+    int ret = 0;
+
+    if (session->staged_size == 0) {
+        pthread_rwlock_rdlock(lock);
+        ret = write_all(session->fd, buf, len);
+        pthread_rwlock_unlock(lock);
+        return ret == -1 ? -1 : fd_rewind(session);
+    }
+
+    pthread_rwlock_wrlock(lock);
+    while (ret == 0 && pos < (off_t)session->staged_size) {
+        ssize_t bytes = pread(session->staged_fd, copy_buf, sizeof(copy_buf), pos);
+
+        if (bytes == -1 && errno == EINTR) continue;
+        if (bytes <= 0) {
+            if (bytes == 0) errno = EIO;
+            ret = -1;
+            break;
+        }
+        ret = write_all(session->fd, copy_buf, bytes);
+        pos += bytes;
+    }
+    if (ret == 0) ret = write_all(session->fd, buf, len);
+    pthread_rwlock_unlock(lock);
+
+    session->staged_size = 0;
+    if (ftruncate(session->staged_fd, 0) == -1) ret = -1;
+    if (ret == -1) return -1;
+    return fd_rewind(session);
+}
+
+/**
+ * Commands are the newline-terminated lines of the file, so find the start
+ * of line @param write_cmd and check it has a byte at @param write_cmd_offset.
+ * An unterminated tail is still a partial write and not a command yet.
+ */
+static int file_seekto(backend_session_t *session, uint32_t write_cmd, uint32_t write_cmd_offset) {
+    char buf[4096];
+    off_t pos = 0;
+    off_t line_start = 0;
+    uint32_t line = 0;
+    ssize_t bytes;
+
+    while ((bytes = pread(session->fd, buf, sizeof(buf), pos)) != 0) {
+        char *p = buf;
+        char *end;
+
+        if (bytes == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        end = buf + bytes;
+        while ((p = memchr(p, '\n', end - p))) {
+            off_t line_end = pos + (p - buf) + 1;
+
+            if (line == write_cmd) {
+                if ((off_t)write_cmd_offset >= line_end - line_start) break;
+                return lseek(session->fd, line_start + write_cmd_offset, SEEK_SET) == -1 ? -1 : 0;
+            }
+            line++;
+            line_start = line_end;
+            p++;
+        }
+        if (p) break;
+        pos += bytes;
+    }
+    errno = EINVAL;
+    return -1;
+}
+
+/**
+ * The file only ever grows, so map what it holds now and search its lines
+ * in place.
+ */
+static ssize_t file_search(backend_session_t *session, const char *pattern, size_t len, int prefix,
+                           struct aesd_seekto *results, size_t max_results) {
+    struct aesd_buffer_entry line;
+    const char *data, *end, *newline;
+    struct stat st;
+    uint32_t write_cmd = 0;
+    size_t found = 0;
+
+    if (fstat(session->fd, &st) == -1) return -1;
+    if (st.st_size == 0) return 0;
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, session->fd, 0);
+    if (data == MAP_FAILED) return -1;
+
+    end = data + st.st_size;
+    for (line.buffptr = data; (newline = memchr(line.buffptr, '\n', end - line.buffptr)); line.buffptr = newline + 1) {
+        line.size = newline + 1 - line.buffptr;
+        found = entry_search(&line, write_cmd++, pattern, len, prefix, results, max_results, found);
+    }
+    munmap((void *)data, st.st_size);
+    return found;
+}
+
+const backend_ops_t file_backend = {
+    .name = "file",
+    .default_path = "/var/tmp/aesdsocketdata",
+    .init = file_init,
+    .cleanup = file_cleanup,
+    .open = file_open,
+    .close = file_close,
+    .write = file_write,
+    .stage = file_stage,
+    // Lines are the commands, so one O_APPEND write() already is a batch
+    .write_batch = file_write,
+    .rewind = fd_rewind,
+    .seekto = file_seekto,
+    .search = file_search,
+    .send = fd_send,
+};
+
+/*
+ * ring backend
+ */
+
+/**
+ * The same history the driver keeps, shared by all connections of a shard.
+ * Writers serialize on the write lock, replies copy their range out under
+ * the read lock and send it after dropping it, so a slow client never stalls
+ * writers.
+ */
+typedef struct ring_shard_t {
+    pthread_rwlock_t lock;
+    struct aesd_circular_buffer buffer;
+    // Bytes of a write that has not seen its newline yet
+    char *partial_entry;
+    size_t partial_entry_size;
+} ring_shard_t;
+
+static ring_shard_t *rings;
+
+static int ring_init(const char *path, unsigned int nr_shards) {
+    unsigned int i;
+
+    (void)path;
+    rings = calloc(nr_shards, sizeof(*rings));
+    if (!rings) return -1;
+    for (i = 0; i < nr_shards; i++) {
+        pthread_rwlock_init(&rings[i].lock, NULL);
+        aesd_circular_buffer_init(&rings[i].buffer);
+    }
+    return 0;
+}
+
+static int ring_open(backend_session_t *session, unsigned int shard) {
+    session->shard = shard;
+    session->pos = 0;
+    session->staged = NULL;
+    session->staged_size = 0;
+    session->staged_capacity = 0;
+    return 0;
+}
+
+static void ring_close(backend_session_t *session) {
+    free(session->staged);
+    session->staged = NULL;
+}
+
+/**
+ * The entry has to live in memory once committed anyway, so stage into a
+ * session buffer that at least grows geometrically.
+ */
+static int ring_stage(backend_session_t *session, const char *buf, size_t len) {
+    if (session->staged_size + len > session->staged_capacity) {
+        size_t capacity = session->staged_capacity ? session->staged_capacity : 4096;
+        char *new_ptr;
+
+        while (capacity < session->staged_size + len) capacity *= 2;
+        new_ptr = realloc(session->staged, capacity);
+        if (!new_ptr) {
+            errno = ENOMEM;
+            return -1;
+        }
+        session->staged = new_ptr;
+        session->staged_capacity = capacity;
+    }
+    memcpy(session->staged + session->staged_size, buf, len);
+    session->staged_size += len;
+    return 0;
+}
+
+static int ring_write(backend_session_t *session, const char *buf, size_t len) {
+    ring_shard_t *ring = &rings[session->shard];
+    struct aesd_buffer_entry entry;
+    const char *overwritten = NULL;
+    char *new_ptr;
+
+    if (session->staged_size > 0) {
+        if (ring_stage(session, buf, len) == -1) {
+            // Like a failed commit below, the packet is dropped whole
+            session->staged_size = 0;
+            return -1;
+        }
+        buf = session->staged;
+        len = session->staged_size;
+    }
+
+    pthread_rwlock_wrlock(&ring->lock);
+    if (!ring->partial_entry && buf == session->staged) {
+        // Nothing to prepend, the staged buffer becomes the entry as is
+        ring->partial_entry = session->staged;
+        ring->partial_entry_size = len;
+        session->staged = NULL;
+        session->staged_capacity = 0;
+    } else {
+        new_ptr = realloc(ring->partial_entry, ring->partial_entry_size + len);
+        if (!new_ptr) {
+            pthread_rwlock_unlock(&ring->lock);
+            session->staged_size = 0;
+            errno = ENOMEM;
+            return -1;
+        }
+        memcpy(new_ptr + ring->partial_entry_size, buf, len);
+        ring->partial_entry = new_ptr;
+        ring->partial_entry_size += len;
+    }
+
+    if (len > 0 && buf[len - 1] == '\n') {
+        entry.buffptr = ring->partial_entry;
+        entry.size = ring->partial_entry_size;
+        overwritten = aesd_circular_buffer_add_entry(&ring->buffer, &entry);
+        ring->partial_entry = NULL;
+        ring->partial_entry_size = 0;
+    }
+    pthread_rwlock_unlock(&ring->lock);
+
+    free((void *)overwritten);
+    session->staged_size = 0;
+    session->pos = 0;
+    return 0;
+}
+
+/**
+ * Copy every command out first, then add them all under one hold of the
+ * write lock. The first one completes any partial write of the shard.
+ */
+static int ring_write_batch(backend_session_t *session, const char *buf, size_t len) {
+    ring_shard_t *ring = &rings[session->shard];
+    struct aesd_buffer_entry entry;
+    const char *end = buf + len;
+    const char *line, *newline;
+    const char **overwritten;
+    char **commands;
+    size_t *sizes;
+    size_t nr_commands = 0, i;
+    int ret = -1;
+
+    for (line = buf; (newline = memchr(line, '\n', end - line)); line = newline + 1) nr_commands++;
+    // An unterminated tail is a partial write, which ring_write() already handles
+    if (nr_commands == 0 || line != end) return ring_write(session, buf, len);
+
+    commands = calloc(nr_commands, sizeof(*commands));
+    sizes = calloc(nr_commands, sizeof(*sizes));
+    overwritten = calloc(nr_commands, sizeof(*overwritten));
+    if (!commands || !sizes || !overwritten) goto out;
+    for (i = 0, line = buf; i < nr_commands; i++, line = newline + 1) {
+        newline = memchr(line, '\n', end - line);
+        sizes[i] = newline + 1 - line;
+        commands[i] = malloc(sizes[i]);
+        if (!commands[i]) goto out;
+        memcpy(commands[i], line, sizes[i]);
+    }
+
+    pthread_rwlock_wrlock(&ring->lock);
+    if (ring->partial_entry) {
+        char *new_ptr = realloc(ring->partial_entry, ring->partial_entry_size + sizes[0]);
+
+        if (!new_ptr) {
+            pthread_rwlock_unlock(&ring->lock);
+            goto out;
+        }
+        memcpy(new_ptr + ring->partial_entry_size, commands[0], sizes[0]);
+        free(commands[0]);
+        commands[0] = new_ptr;
+        sizes[0] += ring->partial_entry_size;
+        ring->partial_entry = NULL;
+        ring->partial_entry_size = 0;
+    }
+    for (i = 0; i < nr_commands; i++) {
+        entry.buffptr = commands[i];
+        entry.size = sizes[i];
+        overwritten[i] = aesd_circular_buffer_add_entry(&ring->buffer, &entry);
+        // Now owned by the ring
+        commands[i] = NULL;
+    }
+    pthread_rwlock_unlock(&ring->lock);
+
+    session->pos = 0;
+    ret = 0;
+out:
+    if (ret == -1) errno = ENOMEM;
+    for (i = 0; commands && i < nr_commands; i++) free(commands[i]);
+    for (i = 0; overwritten && i < nr_commands; i++) free((void *)overwritten[i]);
+    free(commands);
+    free(sizes);
+    free(overwritten);
+    return ret;
+}
+
+static int ring_rewind(backend_session_t *session) {
+    session->pos = 0;
+    return 0;
+}
+
+static int ring_seekto(backend_session_t *session, uint32_t write_cmd, uint32_t write_cmd_offset) {
+    ring_shard_t *ring = &rings[session->shard];
+    struct aesd_buffer_entry *entry;
+    size_t entry_offset;
+    int ret = 0;
+
+    pthread_rwlock_rdlock(&ring->lock);
+    entry = aesd_circular_buffer_get_entry(&ring->buffer, write_cmd, &entry_offset);
+    if (!entry || write_cmd_offset >= entry->size) {
+        errno = EINVAL;
+        ret = -1;
+    } else {
+        session->pos = entry_offset + write_cmd_offset;
+    }
+    pthread_rwlock_unlock(&ring->lock);
+    return ret;
+}
+
+static ssize_t ring_search(backend_session_t *session, const char *pattern, size_t len, int prefix,
+                           struct aesd_seekto *results, size_t max_results) {
+    ring_shard_t *ring = &rings[session->shard];
+    struct aesd_buffer_entry *entry;
+    size_t found = 0;
+    uint32_t i;
+
+    pthread_rwlock_rdlock(&ring->lock);
+    for (i = 0; (entry = aesd_circular_buffer_get_entry(&ring->buffer, i, NULL)); i++)
+        found = entry_search(entry, i, pattern, len, prefix, results, max_results, found);
+    pthread_rwlock_unlock(&ring->lock);
+    return found;
+}
+
+static ssize_t ring_send(backend_session_t *session, int client_fd) {
+    ring_shard_t *ring = &rings[session->shard];
+    struct aesd_buffer_entry *entry;
+    size_t entry_offset, skip, needed = 0, len = 0;
+    char *reply = NULL;
+    unsigned int i;
+    ssize_t ret;
+
+    pthread_rwlock_rdlock(&ring->lock);
+    if (session->pos < aesd_circular_buffer_total_size(&ring->buffer)) {
+        needed = aesd_circular_buffer_total_size(&ring->buffer) - session->pos;
+        reply = malloc(needed);
+        for (i = 0; reply && (entry = aesd_circular_buffer_get_entry(&ring->buffer, i, &entry_offset)); i++) {
+            if (entry_offset + entry->size <= session->pos) continue;
+            skip = session->pos > entry_offset ? session->pos - entry_offset : 0;
+            memcpy(reply + len, entry->buffptr + skip, entry->size - skip);
+            len += entry->size - skip;
+        }
+    }
+    pthread_rwlock_unlock(&ring->lock);
+    if (needed && !reply) return -1;
+
+    // Like a read() to EOF, the position ends up past what was sent
+    session->pos += len;
+    ret = len;
+    if (len > 0 && send_all(client_fd, reply, len) == -1) ret = -1;
+    free(reply);
+    return ret;
+}
+
+const backend_ops_t ring_backend = {
+    .name = "ring",
+    .init = ring_init,
+    .open = ring_open,
+    .close = ring_close,
+    .write = ring_write,
+    .stage = ring_stage,
+    .write_batch = ring_write_batch,
+    .rewind = ring_rewind,
+    .seekto = ring_seekto,
+    .search = ring_search,
+    .send = ring_send,
+};
+
+const backend_ops_t *backend_lookup(const char *name) {
+    static const backend_ops_t *backends[] = { &device_backend, &file_backend, &ring_backend };
+    size_t i;
+
+    for (i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+        if (strcmp(backends[i]->name, name) == 0) return backends[i];
+    }
+    return NULL;
+}
@@ -0,0 +1,116 @@
+/**
+ * @file backend.h
+ * @brief Storage backends for aesdsocket
+ *
+ * Every backend keeps the same write history semantics as the aesdchar
+ * driver: newline-terminated writes are commands, a reply is the history from
+ * the session position to the end, AESDCHAR_IOCSEEKTO moves the position
+ * to a byte of a given command and AESDCHAR_IOCSEARCH finds the commands
+ * holding a pattern.
+ *
+ * A backend may be split into shards, independent histories that clients
+ * are spread over: device and file shards are the path with the shard
+ * number appended (/dev/aesdchar0, /dev/aesdchar1, ...), ring shards are
+ * separate in-process buffers.
+ */
+
+#ifndef AESDSOCKET_BACKEND_H
+#define AESDSOCKET_BACKEND_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+struct aesd_seekto;
+
+/**
+ * Per-connection handle on a backend, kept for the life of the connection
+ */
+typedef struct backend_session_t {
+    unsigned int shard;
+    // Open descriptor of the device and file backends
+    int fd;
+    // Read position of the ring backend, in bytes from its oldest entry
+    size_t pos;
+    // Bytes given to stage() for the packet in progress
+    size_t staged_size;
+    // Where the ring backend keeps them
+    char *staged;
+    size_t staged_capacity;
+    // Where the file backend keeps them, an unlinked file opened on first use
+    int staged_fd;
+} backend_session_t;
+
+typedef struct backend_ops_t {
+    const char *name;
+    // Path used when none is given on the command line, NULL if the backend has none
+    const char *default_path;
+    /**
+     * Called once at startup, @param nr_shards is at least 1.
+     * @return 0 on success, -1 with errno set otherwise.
+     */
+    int (*init)(const char *path, unsigned int nr_shards);
+    /**
+     * Called once on exit, after the workers have finished. May be NULL.
+     */
+    void (*cleanup)(void);
+    /**
+     * Start a session on shard @param shard, less than the nr_shards given to init.
+     */
+    int (*open)(backend_session_t *session, unsigned int shard);
+    /**
+     * End the session. Staged bytes that never saw their write() are dropped,
+     * except by the device backend whose driver keeps them like any partial write.
+     */
+    void (*close)(backend_session_t *session);
+    /**
+     * Append the staged bytes, then @param buf, to the history and rewind the
+     * session to its start.
+     */
+    int (*write)(backend_session_t *session, const char *buf, size_t len);
+    /**
+     * Hold @param buf as the start of a packet too large to buffer whole. The
+     * next write() appends the staged bytes and its own as one unit, so other
+     * sessions never see them interleaved with theirs.
+     */
+    int (*stage)(backend_session_t *session, const char *buf, size_t len);
+    /**
+     * Append the newline-terminated commands in @param buf as one entry each,
+     * in one call where the backend allows, and rewind the session.
+     */
+    int (*write_batch)(backend_session_t *session, const char *buf, size_t len);
+    /**
+     * Move the session back to the start of the history.
+     */
+    int (*rewind)(backend_session_t *session);
+    /**
+     * Move the session to byte @param write_cmd_offset of command @param write_cmd.
+     * @return 0 on success, -1 with errno EINVAL if there is no such byte.
+     */
+    int (*seekto)(backend_session_t *session, uint32_t write_cmd, uint32_t write_cmd_offset);
+    /**
+     * Find the commands holding @param pattern of @param len bytes, or with
+     * @param prefix set only those starting with it. The first @param
+     * max_results matches, oldest first, are stored in @param results as the
+     * positions seekto() takes. The session position is left alone.
+     * @return the number of matches, -1 with errno set on failure.
+     */
+    ssize_t (*search)(backend_session_t *session, const char *pattern, size_t len, int prefix,
+                      struct aesd_seekto *results, size_t max_results);
+    /**
+     * Send the history from the session position to its end to @param client_fd.
+     * @return the number of bytes sent, -1 if the client can no longer be written to.
+     */
+    ssize_t (*send)(backend_session_t *session, int client_fd);
+} backend_ops_t;
+
+extern const backend_ops_t device_backend;
+extern const backend_ops_t file_backend;
+extern const backend_ops_t ring_backend;
+
+/**
+ * @return the backend called @param name, or NULL if there is none
+ */
+extern const backend_ops_t *backend_lookup(const char *name);
+
+#endif /* AESDSOCKET_BACKEND_H */
@@ -0,0 +1,133 @@
+/**
+ * @file group_commit.c
+ * @brief Coalescing of small concurrent writes into one backend call
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "group_commit.h"
+
+// Largest group handed to the backend at once
+#define GROUP_COMMIT_BYTES (64 * 1024)
+// Larger packets gain nothing from grouping and go straight to the backend
+#define GROUP_COMMIT_MAX_PACKET (4 * 1024)
+// The leader stops waiting once the next packet might not fit
+#define GROUP_COMMIT_FLUSH_BYTES (GROUP_COMMIT_BYTES - GROUP_COMMIT_MAX_PACKET)
+
+typedef struct commit_group_t {
+    pthread_mutex_t lock;
+    // Signalled when the filling group reaches GROUP_COMMIT_FLUSH_BYTES
+    pthread_cond_t full;
+    // Broadcast when the leader takes a group and again when it is written
+    pthread_cond_t done;
+    // Group being filled, NULL when there is none
+    char *buf;
+    size_t len;
+    // Sequence number of the last group started, written and failed
+    uint64_t seq;
+    uint64_t written_seq;
+    uint64_t failed_seq;
+} commit_group_t;
+
+static const backend_ops_t *commit_ops;
+static commit_group_t *groups;
+static long commit_window_us;
+
+int group_commit_init(const backend_ops_t *ops, unsigned int nr_shards, long window_us) {
+    pthread_condattr_t attr;
+    unsigned int i;
+
+    commit_ops = ops;
+    commit_window_us = window_us;
+    if (window_us <= 0) return 0;
+
+    groups = calloc(nr_shards, sizeof(*groups));
+    if (!groups) return -1;
+    // The leader's deadline must not move with the wall clock
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    for (i = 0; i < nr_shards; i++) {
+        pthread_mutex_init(&groups[i].lock, NULL);
+        pthread_cond_init(&groups[i].full, &attr);
+        pthread_cond_init(&groups[i].done, NULL);
+    }
+    pthread_condattr_destroy(&attr);
+    return 0;
+}
+
+int group_commit_write(backend_session_t *session, const char *buf, size_t len) {
+    commit_group_t *group;
+    struct timespec deadline;
+    uint64_t seq;
+    char *batch;
+    size_t batch_len;
+    int leader = 0;
+    int ret;
+
+    // Partial writes must stay with their session, so only whole small commands are grouped
+    if (!groups || len == 0 || len > GROUP_COMMIT_MAX_PACKET || buf[len - 1] != '\n' || session->staged_size)
+        return commit_ops->write(session, buf, len);
+
+    group = &groups[session->shard];
+    pthread_mutex_lock(&group->lock);
+    while (group->buf && group->len + len > GROUP_COMMIT_BYTES) {
+        pthread_cond_signal(&group->full);
+        pthread_cond_wait(&group->done, &group->lock);
+    }
+    if (!group->buf) {
+        group->buf = malloc(GROUP_COMMIT_BYTES);
+        if (!group->buf) {
+            pthread_mutex_unlock(&group->lock);
+            return commit_ops->write(session, buf, len);
+        }
+        group->len = 0;
+        group->seq++;
+        leader = 1;
+    }
+    memcpy(group->buf + group->len, buf, len);
+    group->len += len;
+    seq = group->seq;
+    if (group->len >= GROUP_COMMIT_FLUSH_BYTES) pthread_cond_signal(&group->full);
+
+    if (!leader) {
+        while (group->written_seq < seq) pthread_cond_wait(&group->done, &group->lock);
+        ret = group->failed_seq == seq ? -1 : 0;
+        pthread_mutex_unlock(&group->lock);
+        if (ret == -1) {
+            errno = EIO;
+            return -1;
+        }
+        return commit_ops->rewind(session);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_nsec += (commit_window_us % 1000000) * 1000;
+    deadline.tv_sec += commit_window_us / 1000000 + deadline.tv_nsec / 1000000000;
+    deadline.tv_nsec %= 1000000000;
+    while (group->len < GROUP_COMMIT_FLUSH_BYTES) {
+        if (pthread_cond_timedwait(&group->full, &group->lock, &deadline) == ETIMEDOUT) break;
+    }
+    // Later packets start the next group while this one is written
+    batch = group->buf;
+    batch_len = group->len;
+    group->buf = NULL;
+    pthread_cond_broadcast(&group->done);
+    // Groups reach the backend in order, which also keeps written_seq meaningful
+    while (group->written_seq + 1 < seq) pthread_cond_wait(&group->done, &group->lock);
+    pthread_mutex_unlock(&group->lock);
+
+    ret = commit_ops->write_batch(session, batch, batch_len);
+    free(batch);
+
+    pthread_mutex_lock(&group->lock);
+    group->written_seq = seq;
+    if (ret == -1) group->failed_seq = seq;
+    pthread_cond_broadcast(&group->done);
+    pthread_mutex_unlock(&group->lock);
+    return ret;
+}
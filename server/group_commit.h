@@ -0,0 +1,33 @@
+/**
+ * @file group_commit.h
+ * @brief Coalescing of small concurrent writes into one backend call
+ *
+ * The first small packet to reach an idle shard becomes the leader of a
+ * group: it waits up to the commit window for others to join, then hands
+ * the whole group to the backend's write_batch() and wakes the followers,
+ * which only rewind their session before sending their reply. Every packet
+ * still becomes its own write command.
+ */
+
+#ifndef AESDSOCKET_GROUP_COMMIT_H
+#define AESDSOCKET_GROUP_COMMIT_H
+
+#include <stddef.h>
+
+#include "backend.h"
+
+/**
+ * Set up one group per shard of @param ops. A @param window_us of 0 leaves
+ * group commit disabled and group_commit_write() a plain backend write.
+ * @return 0 on success, -1 otherwise.
+ */
+extern int group_commit_init(const backend_ops_t *ops, unsigned int nr_shards, long window_us);
+
+/**
+ * Like backend write(): when the history includes @param buf the session
+ * has been rewound. Only small newline-terminated packets are grouped.
+ * @return 0 on success, -1 otherwise.
+ */
+extern int group_commit_write(backend_session_t *session, const char *buf, size_t len);
+
+#endif /* AESDSOCKET_GROUP_COMMIT_H */
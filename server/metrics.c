@@ -0,0 +1,248 @@
+/**
+ * @file metrics.c
+ * @brief Counters and latency histograms for aesdsocket
+ */
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "metrics.h"
+
+// How long a scraper gets to send its request before the reply goes out anyway
+#define METRICS_REQUEST_TIMEOUT_MS 200
+
+_Thread_local metrics_thread_t *metrics_self;
+atomic_long metrics_active_connections;
+
+static metrics_thread_t *slots;
+static unsigned int nr_slots;
+static atomic_uint next_slot;
+
+static int metrics_listen_fd = -1;
+static int dump_pipe[2] = { -1, -1 };
+static long metrics_workers;
+static size_t (*metrics_queue_length)(void);
+
+static const struct {
+    const char *name;
+    const char *help;
+} counter_info[METRIC_COUNTERS] = {
+    [METRIC_ACCEPTED] = { "aesdsocket_connections_accepted_total", "Client connections accepted" },
+    [METRIC_PACKETS] = { "aesdsocket_packets_total", "Packets processed" },
+    [METRIC_BYTES_IN] = { "aesdsocket_received_bytes_total", "Bytes received from clients" },
+    [METRIC_BYTES_OUT] = { "aesdsocket_sent_bytes_total", "Reply bytes sent to clients" },
+    [METRIC_BACKEND_ERRORS] = { "aesdsocket_backend_errors_total", "Failed backend opens, writes and seeks" },
+    [METRIC_SEND_ERRORS] = { "aesdsocket_send_errors_total", "Replies that could not be sent" },
+};
+
+static const struct {
+    const char *name;
+    const char *help;
+    // Multiplier from the recorded unit to the exported one
+    double scale;
+} hist_info[METRIC_HISTS] = {
+    [METRIC_PACKET_SIZE] = { "aesdsocket_packet_size_bytes", "Packet sizes", 1.0 },
+    [METRIC_WRITE_LATENCY] = { "aesdsocket_backend_write_seconds", "Backend write or seek time", 1e-6 },
+    [METRIC_SEND_LATENCY] = { "aesdsocket_reply_send_seconds", "Reply send time", 1e-6 },
+    [METRIC_REQUEST_LATENCY] = { "aesdsocket_request_seconds", "Time from a packet being queued to its reply being sent", 1e-6 },
+};
+
+int metrics_init(unsigned int max_threads) {
+    if (max_threads == 0) max_threads = 1;
+    // Slots are whole cache lines, so each thread writes to lines of its own
+    slots = aligned_alloc(_Alignof(metrics_thread_t), max_threads * sizeof(*slots));
+    if (!slots) return -1;
+    memset(slots, 0, max_threads * sizeof(*slots));
+    nr_slots = max_threads;
+    return 0;
+}
+
+void metrics_thread_register(void) {
+    unsigned int slot;
+
+    if (!slots) return;
+    slot = atomic_fetch_add_explicit(&next_slot, 1, memory_order_relaxed);
+    metrics_self = &slots[slot < nr_slots ? slot : nr_slots - 1];
+}
+
+static unsigned long counter_sum(metrics_counter_t counter) {
+    unsigned long sum = 0;
+    unsigned int i;
+
+    for (i = 0; i < nr_slots; i++)
+        sum += atomic_load_explicit(&slots[i].counters[counter], memory_order_relaxed);
+    return sum;
+}
+
+/**
+ * Write every metric to @param out in the Prometheus text exposition format
+ */
+static void metrics_render(FILE *out) {
+    unsigned int used = atomic_load_explicit(&next_slot, memory_order_relaxed);
+    unsigned int c, h, b, i;
+
+    if (used > nr_slots) used = nr_slots;
+
+    for (c = 0; c < METRIC_COUNTERS; c++) {
+        fprintf(out, "# HELP %s %s\n# TYPE %s counter\n%s %lu\n", counter_info[c].name, counter_info[c].help,
+                counter_info[c].name, counter_info[c].name, counter_sum(c));
+    }
+
+    fprintf(out, "# HELP aesdsocket_thread_packets_total Packets processed by each thread\n"
+                 "# TYPE aesdsocket_thread_packets_total counter\n");
+    for (i = 0; i < used; i++) {
+        fprintf(out, "aesdsocket_thread_packets_total{thread=\"%u\"} %lu\n", i,
+                atomic_load_explicit(&slots[i].counters[METRIC_PACKETS], memory_order_relaxed));
+    }
+
+    fprintf(out, "# TYPE aesdsocket_connections_active gauge\naesdsocket_connections_active %ld\n",
+            atomic_load_explicit(&metrics_active_connections, memory_order_relaxed));
+    fprintf(out, "# TYPE aesdsocket_workers gauge\naesdsocket_workers %ld\n", metrics_workers);
+    if (metrics_queue_length)
+        fprintf(out, "# TYPE aesdsocket_queue_length gauge\naesdsocket_queue_length %zu\n", metrics_queue_length());
+
+    for (h = 0; h < METRIC_HISTS; h++) {
+        unsigned long buckets[METRICS_BUCKETS] = { 0 };
+        unsigned long sum = 0, cumulative = 0;
+
+        for (i = 0; i < nr_slots; i++) {
+            for (b = 0; b < METRICS_BUCKETS; b++)
+                buckets[b] += atomic_load_explicit(&slots[i].hists[h].buckets[b], memory_order_relaxed);
+            sum += atomic_load_explicit(&slots[i].hists[h].sum, memory_order_relaxed);
+        }
+
+        fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", hist_info[h].name, hist_info[h].help, hist_info[h].name);
+        // The last bucket is open ended and only shows up in +Inf
+        for (b = 0; b < METRICS_BUCKETS - 1; b++) {
+            cumulative += buckets[b];
+            fprintf(out, "%s_bucket{le=\"%g\"} %lu\n", hist_info[h].name,
+                    (double)(1UL << (b + 1)) * hist_info[h].scale, cumulative);
+        }
+        cumulative += buckets[METRICS_BUCKETS - 1];
+        fprintf(out, "%s_bucket{le=\"+Inf\"} %lu\n%s_sum %g\n%s_count %lu\n", hist_info[h].name, cumulative,
+                hist_info[h].name, sum * hist_info[h].scale, hist_info[h].name, cumulative);
+    }
+}
+
+static void metrics_dump_syslog(void) {
+    char *text = NULL, *line, *saveptr;
+    size_t len = 0;
+    FILE *out = open_memstream(&text, &len);
+
+    if (!out) return;
+    metrics_render(out);
+    fclose(out);
+
+    for (line = strtok_r(text, "\n", &saveptr); line; line = strtok_r(NULL, "\n", &saveptr)) {
+        if (line[0] != '#') syslog(LOG_INFO, "%s", line);
+    }
+    free(text);
+}
+
+static void metrics_serve(int client_fd) {
+    struct pollfd pfd = { .fd = client_fd, .events = POLLIN };
+    char request[1024];
+    char *body = NULL;
+    size_t body_len = 0;
+    FILE *out;
+
+    // Consume the request if one comes, a bare "nc localhost port" works too
+    if (poll(&pfd, 1, METRICS_REQUEST_TIMEOUT_MS) > 0)
+        (void)recv(client_fd, request, sizeof(request), MSG_DONTWAIT);
+
+    out = open_memstream(&body, &body_len);
+    if (!out) return;
+    metrics_render(out);
+    fclose(out);
+
+    dprintf(client_fd, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                       "Content-Length: %zu\r\nConnection: close\r\n\r\n", body_len);
+    send(client_fd, body, body_len, MSG_NOSIGNAL);
+    free(body);
+}
+
+static void *metrics_routine(void *arg) {
+    struct pollfd pfds[2];
+    nfds_t nfds = 1;
+    char byte;
+
+    (void)arg;
+    pfds[0].fd = dump_pipe[0];
+    pfds[0].events = POLLIN;
+    if (metrics_listen_fd >= 0) {
+        pfds[1].fd = metrics_listen_fd;
+        pfds[1].events = POLLIN;
+        nfds = 2;
+    }
+
+    while (1) {
+        if (poll(pfds, nfds, -1) == -1) {
+            if (errno == EINTR) continue;
+            syslog(LOG_ERR, "Metrics poll failed: %m");
+            return NULL;
+        }
+        if (pfds[0].revents & POLLIN) {
+            while (read(dump_pipe[0], &byte, 1) == 1)
+                ;
+            metrics_dump_syslog();
+        }
+        if (nfds == 2 && (pfds[1].revents & POLLIN)) {
+            int client_fd = accept4(metrics_listen_fd, NULL, NULL, SOCK_CLOEXEC);
+
+            if (client_fd >= 0) {
+                metrics_serve(client_fd);
+                close(client_fd);
+            }
+        }
+    }
+    return NULL;
+}
+
+void metrics_request_dump(void) {
+    char byte = 0;
+
+    if (dump_pipe[1] >= 0) (void)write(dump_pipe[1], &byte, 1);
+}
+
+int metrics_start(int port, long workers, size_t (*queue_length)(void)) {
+    pthread_t thread;
+
+    metrics_workers = workers;
+    metrics_queue_length = queue_length;
+
+    if (pipe2(dump_pipe, O_NONBLOCK | O_CLOEXEC) == -1) return -1;
+
+    if (port > 0) {
+        struct sockaddr_in address = {
+            .sin_family = AF_INET,
+            .sin_port = htons(port),
+            .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+        };
+        int yes = 1;
+
+        metrics_listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (metrics_listen_fd == -1) return -1;
+        setsockopt(metrics_listen_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+        if (bind(metrics_listen_fd, (struct sockaddr *)&address, sizeof(address)) == -1 ||
+            listen(metrics_listen_fd, 4) == -1) {
+            close(metrics_listen_fd);
+            metrics_listen_fd = -1;
+            return -1;
+        }
+    }
+
+    if (pthread_create(&thread, NULL, metrics_routine, NULL) != 0) return -1;
+    pthread_detach(thread);
+    return 0;
+}
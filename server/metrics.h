@@ -0,0 +1,122 @@
+/**
+ * @file metrics.h
+ * @brief Counters and latency histograms for aesdsocket
+ *
+ * Every thread that updates metrics registers its own slot, so the hot path
+ * only touches thread-local cache lines. Readers sum the slots, either when
+ * the Prometheus text endpoint is scraped or when SIGUSR1 asks for a dump to
+ * syslog.
+ */
+
+#ifndef AESDSOCKET_METRICS_H
+#define AESDSOCKET_METRICS_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+typedef enum metrics_counter_t {
+    METRIC_ACCEPTED,
+    METRIC_PACKETS,
+    METRIC_BYTES_IN,
+    METRIC_BYTES_OUT,
+    METRIC_BACKEND_ERRORS,
+    METRIC_SEND_ERRORS,
+    METRIC_COUNTERS
+} metrics_counter_t;
+
+typedef enum metrics_hist_id_t {
+    // Bytes per packet
+    METRIC_PACKET_SIZE,
+    // Backend write or seek, in microseconds
+    METRIC_WRITE_LATENCY,
+    // Sending the reply, in microseconds
+    METRIC_SEND_LATENCY,
+    // From a complete packet being queued to its reply being sent, in microseconds
+    METRIC_REQUEST_LATENCY,
+    METRIC_HISTS
+} metrics_hist_id_t;
+
+/**
+ * Bucket i counts values in [2^i, 2^(i+1)), the last one everything above
+ */
+#define METRICS_BUCKETS 24
+
+typedef struct metrics_hist_t {
+    atomic_ulong buckets[METRICS_BUCKETS];
+    atomic_ulong sum;
+} metrics_hist_t;
+
+/**
+ * Written by one thread only. The alignment rounds the size up to whole cache
+ * lines too, so neighbouring slots of an array never share one.
+ */
+typedef struct metrics_thread_t {
+    atomic_ulong counters[METRIC_COUNTERS];
+    metrics_hist_t hists[METRIC_HISTS];
+} __attribute__((aligned(64))) metrics_thread_t;
+
+// Slot of the calling thread, set by metrics_thread_register()
+extern _Thread_local metrics_thread_t *metrics_self;
+// Connections currently open
+extern atomic_long metrics_active_connections;
+
+/**
+ * Allocate slots for up to @param max_threads threads.
+ * @return 0 on success, -1 otherwise.
+ */
+extern int metrics_init(unsigned int max_threads);
+
+/**
+ * Give the calling thread its own slot. Threads past max_threads share the
+ * last one, which stays correct since all updates are atomic.
+ */
+extern void metrics_thread_register(void);
+
+/**
+ * Start the thread serving metrics in Prometheus text format on
+ * 127.0.0.1:@param port, 0 for none, and dumping them to syslog on SIGUSR1.
+ * @param workers and @param queue_length are reported as gauges.
+ * @return 0 on success, -1 otherwise.
+ */
+extern int metrics_start(int port, long workers, size_t (*queue_length)(void));
+
+/**
+ * Async-signal-safe: ask the metrics thread for a syslog dump
+ */
+extern void metrics_request_dump(void);
+
+static inline uint64_t metrics_now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void metrics_count(metrics_counter_t counter, unsigned long value) {
+    if (metrics_self) atomic_fetch_add_explicit(&metrics_self->counters[counter], value, memory_order_relaxed);
+}
+
+static inline void metrics_observe(metrics_hist_id_t hist, unsigned long value) {
+    unsigned int bucket;
+
+    if (!metrics_self) return;
+    bucket = value ? 63 - __builtin_clzll(value) : 0;
+    if (bucket >= METRICS_BUCKETS) bucket = METRICS_BUCKETS - 1;
+    atomic_fetch_add_explicit(&metrics_self->hists[hist].buckets[bucket], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&metrics_self->hists[hist].sum, value, memory_order_relaxed);
+}
+
+/**
+ * Record the microseconds elapsed since @param start_ns, from metrics_now_ns()
+ * @return the current time, to chain measurements
+ */
+static inline uint64_t metrics_observe_since(metrics_hist_id_t hist, uint64_t start_ns) {
+    uint64_t now = metrics_now_ns();
+
+    metrics_observe(hist, (now - start_ns) / 1000);
+    return now;
+}
+
+#endif /* AESDSOCKET_METRICS_H */
@@ -0,0 +1,49 @@
+#!/bin/bash
+# Tester for clients that never read their reply
+#
+# Starts aesdsocket with two workers and a history of several MiB, then opens
+# two connections that send a packet and never read the reply. Both workers
+# block sending to them until the send timeout drops the clients, after which
+# a third, well-behaved client must still get its reply.
+
+aesdsocket=${AESDSOCKET:-/usr/bin/aesdsocket}
+target=localhost
+port=9000
+send_timeout=2
+rc=0
+
+killall -9 aesdsocket 2>/dev/null
+sleep 1
+${aesdsocket} -d -b ring -w 2 -T ${send_timeout} || exit 1
+sleep 1
+
+# Four 1 MiB writes, far more than the socket buffers of a client that never reads
+for i in 1 2 3 4; do
+	{ head -c 1048576 /dev/zero | tr '\0' "${i}"; echo; } | nc ${target} ${port} -w 1 > /dev/null
+done
+
+echo "Opening two clients that never read their reply"
+exec 3<>/dev/tcp/${target}/${port}
+exec 4<>/dev/tcp/${target}/${port}
+echo "stall" >&3
+echo "stall" >&4
+sleep 1
+
+echo "Sending from a third client"
+start=$(date +%s)
+result=$(echo "ok" | timeout $((send_timeout * 5)) nc ${target} ${port} -w 1 | tail -n 1)
+elapsed=$(( $(date +%s) - start ))
+if [ "${result}" != "ok" ]; then
+	echo "Third client got no reply while two clients stalled the workers"
+	rc=1
+else
+	echo "Third client answered after ${elapsed} s"
+fi
+
+exec 3>&-
+exec 4>&-
+killall aesdsocket
+if [ ${rc} -eq 0 ]; then
+	echo "Test passed"
+fi
+exit ${rc}
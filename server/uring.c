@@ -0,0 +1,175 @@
+/**
+ * @file uring.c
+ * @brief Minimal io_uring wrapper on the raw system calls
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+static const int uring_required_ops[] = {
+    IORING_OP_ACCEPT,
+    IORING_OP_RECV,
+    IORING_OP_READ,
+    IORING_OP_POLL_ADD,
+    IORING_OP_TIMEOUT,
+    IORING_OP_ASYNC_CANCEL,
+};
+
+static int uring_setup(unsigned int entries, struct io_uring_params *params) {
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int uring_register(int fd, unsigned int opcode, void *arg, unsigned int nr_args) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/**
+ * Kernels before 5.6 cannot be probed, and miss IORING_OP_RECV anyway
+ */
+static int uring_probe(uring_t *ring) {
+    size_t nr_ops = sizeof(uring_required_ops) / sizeof(uring_required_ops[0]);
+    struct io_uring_probe *probe;
+    size_t i;
+    int ret = 0;
+
+    probe = calloc(1, sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op));
+    if (!probe) return -1;
+    if (uring_register(ring->fd, IORING_REGISTER_PROBE, probe, 256) == -1) {
+        ret = -1;
+        errno = ENOSYS;
+        goto out;
+    }
+    for (i = 0; i < nr_ops; i++) {
+        int op = uring_required_ops[i];
+
+        if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+            ret = -1;
+            errno = ENOSYS;
+            break;
+        }
+    }
+out:
+    free(probe);
+    return ret;
+}
+
+int uring_init(uring_t *ring, unsigned int entries) {
+    struct io_uring_params params;
+    unsigned int *sq_array;
+    unsigned int i;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+    ring->fd = uring_setup(entries, &params);
+    if (ring->fd == -1) return -1;
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    // Since 5.4 both rings share one mapping
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = 0;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                         IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) goto err;
+    if (ring->cq_ring_size) {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                             IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) goto err;
+    } else {
+        ring->cq_ring = ring->sq_ring;
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                      IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) goto err;
+
+    ring->sq_head = (unsigned int *)((char *)ring->sq_ring + params.sq_off.head);
+    ring->sq_tail = (unsigned int *)((char *)ring->sq_ring + params.sq_off.tail);
+    ring->sq_mask = *(unsigned int *)((char *)ring->sq_ring + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->cq_head = (unsigned int *)((char *)ring->cq_ring + params.cq_off.head);
+    ring->cq_tail = (unsigned int *)((char *)ring->cq_ring + params.cq_off.tail);
+    ring->cq_mask = *(unsigned int *)((char *)ring->cq_ring + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ring + params.cq_off.cqes);
+    ring->sqe_tail = *ring->sq_tail;
+
+    // SQE i always sits in slot i, so the index array is filled once
+    sq_array = (unsigned int *)((char *)ring->sq_ring + params.sq_off.array);
+    for (i = 0; i < params.sq_entries; i++) sq_array[i] = i;
+
+    if (uring_probe(ring) == -1) goto err;
+    return 0;
+
+err:
+    i = errno;
+    uring_exit(ring);
+    errno = i;
+    return -1;
+}
+
+void uring_exit(uring_t *ring) {
+    if (ring->sqes && ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring_size && ring->cq_ring && ring->cq_ring != MAP_FAILED) munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sq_ring && ring->sq_ring != MAP_FAILED) munmap(ring->sq_ring, ring->sq_ring_size);
+    if (ring->fd >= 0) close(ring->fd);
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+/**
+ * Make the SQEs filled so far visible to the kernel
+ * @return how many are waiting to be submitted
+ */
+static unsigned int uring_flush(uring_t *ring) {
+    unsigned int tail = *ring->sq_tail;
+
+    if (tail != ring->sqe_tail) __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+    return ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+}
+
+struct io_uring_sqe *uring_get_sqe(uring_t *ring) {
+    struct io_uring_sqe *sqe;
+
+    if (ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+        if (uring_submit_and_wait(ring, 0) == -1) return NULL;
+    }
+    sqe = &ring->sqes[ring->sqe_tail & ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sqe_tail++;
+    return sqe;
+}
+
+int uring_submit_and_wait(uring_t *ring, unsigned int wait_nr) {
+    unsigned int to_submit = uring_flush(ring);
+    int ret;
+
+    if (!to_submit && !wait_nr) return 0;
+    do {
+        ret = uring_enter(ring->fd, to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0);
+    } while (ret == -1 && errno == EINTR);
+    return ret == -1 ? -1 : 0;
+}
+
+struct io_uring_cqe *uring_peek_cqe(uring_t *ring) {
+    unsigned int head = *ring->cq_head;
+
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) return NULL;
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_cqe_seen(uring_t *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
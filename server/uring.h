@@ -0,0 +1,82 @@
+/**
+ * @file uring.h
+ * @brief Minimal io_uring wrapper on the raw system calls
+ *
+ * Only what the aesdsocket reactor needs: one submission and completion
+ * queue pair per ring, SQEs filled in place and published in batches by the
+ * io_uring_enter() that also waits for completions.
+ */
+
+#ifndef AESDSOCKET_URING_H
+#define AESDSOCKET_URING_H
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+typedef struct uring_t {
+    int fd;
+    // Shared with the kernel
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int sq_mask;
+    unsigned int sq_entries;
+    struct io_uring_sqe *sqes;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int cq_mask;
+    struct io_uring_cqe *cqes;
+    // SQEs handed out by uring_get_sqe() and not published yet
+    unsigned int sqe_tail;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+} uring_t;
+
+/**
+ * Set up @param ring with room for @param entries submissions, and check the
+ * kernel supports every opcode aesdsocket uses.
+ * @return 0 on success, -1 with errno set otherwise, ENOSYS when the kernel
+ *         has no usable io_uring.
+ */
+extern int uring_init(uring_t *ring, unsigned int entries);
+
+extern void uring_exit(uring_t *ring);
+
+/**
+ * @return a zeroed SQE to fill, submitting the pending ones first when the
+ *         queue is full, or NULL if even that fails.
+ */
+extern struct io_uring_sqe *uring_get_sqe(uring_t *ring);
+
+/**
+ * Publish the pending SQEs and wait until at least @param wait_nr
+ * completions are available, in one system call.
+ * @return 0 on success, -1 with errno set otherwise.
+ */
+extern int uring_submit_and_wait(uring_t *ring, unsigned int wait_nr);
+
+/**
+ * @return the oldest completion not yet seen, NULL if there is none
+ */
+extern struct io_uring_cqe *uring_peek_cqe(uring_t *ring);
+
+/**
+ * Hand the completion returned by uring_peek_cqe() back to the kernel
+ */
+extern void uring_cqe_seen(uring_t *ring);
+
+static inline void uring_prep(struct io_uring_sqe *sqe, int opcode, int fd, const void *addr, unsigned int len,
+                              uint64_t off, void *user_data) {
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)addr;
+    sqe->len = len;
+    sqe->off = off;
+    sqe->user_data = (uintptr_t)user_data;
+}
+
+#endif /* AESDSOCKET_URING_H */
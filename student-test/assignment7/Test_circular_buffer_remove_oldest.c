@@ -0,0 +1,82 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include "../../aesd-char-driver/aesd-circular-buffer.h"
+
+static const char *entry_data[] = {
+    "write1\n", "write2\n", "write3\n", "write4\n", "write5\n", "write6\n",
+    "write7\n", "write8\n", "write9\n", "write10\n", "write11\n", "write12\n",
+};
+
+static void add_entry(struct aesd_circular_buffer *buffer, unsigned int i)
+{
+    struct aesd_buffer_entry entry = {
+        .buffptr = entry_data[i],
+        .size = 7,
+    };
+
+    aesd_circular_buffer_add_entry(buffer, &entry);
+}
+
+/**
+ * Count the slots AESD_CIRCULAR_BUFFER_FOREACH would hand to a cleanup loop
+ */
+static unsigned int count_owned_slots(struct aesd_circular_buffer *buffer)
+{
+    struct aesd_buffer_entry *entry;
+    unsigned int owned = 0;
+    uint32_t index;
+
+    AESD_CIRCULAR_BUFFER_FOREACH(entry, buffer, index) {
+        if (entry->buffptr)
+            owned++;
+    }
+    return owned;
+}
+
+/**
+ * Entries evicted with aesd_circular_buffer_remove_oldest() are freed by the
+ * caller, so the driver's cleanup loop must not find them in the buffer again.
+ */
+void test_circular_buffer_remove_oldest_clears_slot()
+{
+    struct aesd_circular_buffer buffer;
+    unsigned int i;
+
+    aesd_circular_buffer_init(&buffer);
+    for (i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++)
+        add_entry(&buffer, i);
+
+    TEST_ASSERT_EQUAL_PTR_MESSAGE(entry_data[0], aesd_circular_buffer_remove_oldest(&buffer),
+                                  "remove_oldest should return the oldest entry");
+    TEST_ASSERT_EQUAL_PTR(entry_data[1], aesd_circular_buffer_remove_oldest(&buffer));
+    TEST_ASSERT_EQUAL_UINT_MESSAGE(AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - 2, count_owned_slots(&buffer),
+                                   "Removed entries should no longer be visible to AESD_CIRCULAR_BUFFER_FOREACH");
+    TEST_ASSERT_EQUAL_UINT(aesd_circular_buffer_count(&buffer), count_owned_slots(&buffer));
+}
+
+/**
+ * The restore path empties the buffer entry by entry, then adds fewer entries
+ * than it held: the slots left over must not keep the evicted pointers.
+ */
+void test_circular_buffer_remove_all_then_refill()
+{
+    struct aesd_circular_buffer buffer;
+    unsigned int i;
+
+    aesd_circular_buffer_init(&buffer);
+    for (i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED + 2; i++)
+        add_entry(&buffer, i);
+
+    while (aesd_circular_buffer_remove_oldest(&buffer))
+        ;
+    TEST_ASSERT_EQUAL_UINT(0, aesd_circular_buffer_count(&buffer));
+    TEST_ASSERT_EQUAL_UINT_MESSAGE(0, count_owned_slots(&buffer),
+                                   "An emptied buffer should own no slots");
+    TEST_ASSERT_EQUAL_UINT(0, aesd_circular_buffer_total_size(&buffer));
+
+    add_entry(&buffer, 0);
+    add_entry(&buffer, 1);
+    TEST_ASSERT_EQUAL_UINT(2, count_owned_slots(&buffer));
+    TEST_ASSERT_NULL(aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, 14, NULL));
+}